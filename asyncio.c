@@ -20,8 +20,12 @@
 * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
 * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 ******************************************************************************/
+#define _GNU_SOURCE
 #include <fcntl.h>
 #include <sys/time.h>
+#include <sys/uio.h>
+#include <limits.h>
+#include <inttypes.h>
 #include <sys/param.h>
 #include <netdb.h>
 #include <assert.h>
@@ -34,8 +38,19 @@
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 #include <arpa/inet.h>
+#include <dlfcn.h>
 #ifdef __linux__
 #include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
+#include <sys/sendfile.h>
+#include <netinet/udp.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#ifdef WITH_IO_URING
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#endif
 #elif defined(__APPLE__)
 #include <sys/event.h>
 #else
@@ -46,6 +61,14 @@
 #include <openssl/ssl.h>
 #include <openssl/err.h>
 #include <openssl/x509v3.h>
+#include <openssl/rand.h>
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#include <openssl/core_names.h>
+#define ASYNCIO_TICKET_KEY_CB
+#endif
+#if defined(SSL_OP_ENABLE_KTLS) && !defined(OPENSSL_NO_KTLS)
+#define ASYNCIO_KTLS
+#endif
 #endif
 
 #include "queue.h"
@@ -53,15 +76,66 @@
 #include "trace.h"
 #include "talloc.h"
 #include "sock.h"
+#include "cfg.h"
+#include "threading.h"
+#include "misc.h"
+#include "cmd.h"
+#include "task.h"
 
 LIST_HEAD(asyncio_timer_list, asyncio_timer);
-LIST_HEAD(asyncio_worker_list, asyncio_worker);
 
 struct asyncio_sslctx {
   SSL_CTX *ctx;
+  atomic_t refcount;
   int client;
 };
 
+typedef struct asyncio_loop asyncio_loop_t;
+
+/**
+ * Listener state, only allocated for fds created by asyncio_bind_ex()
+ */
+typedef struct asyncio_listener {
+  asyncio_timer_t asl_timer; // Resumes accepting after a pause
+  int asl_flags;
+  int asl_rate;              // Max accepts per second, 0 for unlimited
+  double asl_tokens;
+  int64_t asl_refill;
+} asyncio_listener_t;
+
+/**
+ * File segment queued with asyncio_sendfile(). asf_mbuf_bytes is the
+ * number of bytes in af_sendq (counted from the end of the previous
+ * segment) that must be sent before this one.
+ */
+typedef struct asyncio_sendfile {
+  TAILQ_ENTRY(asyncio_sendfile) asf_link;
+  int asf_fd;
+  off_t asf_offset;
+  int64_t asf_len;
+  size_t asf_mbuf_bytes;
+} asyncio_sendfile_t;
+
+TAILQ_HEAD(asyncio_sendfile_queue, asyncio_sendfile);
+
+
+/**
+ * Resolver and connect state for asyncio_connect()
+ */
+typedef struct asyncio_dial {
+  asyncio_timer_t ad_timer;
+  struct addrinfo *ad_res;
+  const struct addrinfo *ad_next; // Next address to try
+  int ad_timeout;                 // In ms, for the whole connect
+  int ad_gai_err;
+  int ad_error;                   // errno from the last attempt
+  int ad_done;                    // Connect callback invoked or fd closed
+} asyncio_dial_t;
+
+#ifdef WITH_IO_URING
+typedef struct asyncio_uring asyncio_uring_t;
+#endif
+
 
 /**
  *
@@ -74,82 +148,248 @@ struct asyncio_fd {
   asyncio_poll_cb_t *af_pollout;
   asyncio_read_cb_t *af_bytes_avail;
   asyncio_connect_cb_t *af_connect;
+  asyncio_dgram_cb_t *af_dgram_input;
 
   int (*af_locked_write)(struct asyncio_fd *af);
 
   void *af_opaque;
 
+  asyncio_loop_t *af_loop;
+  struct asyncio_fd *af_next_shard; // Listeners bound on other loops
+  asyncio_listener_t *af_listener;
+  asyncio_dial_t *af_dial;          // Only set for asyncio_connect()
+
   mbuf_t af_sendq;
   mbuf_t af_recvq;
 
+  struct asyncio_sendfile_queue af_sendfiles;
+  size_t af_sendfile_marked; // Sum of asf_mbuf_bytes for all segments
+  int64_t af_sendfile_bytes; // Sum of asf_len for all segments
+
+  // Send queue watermarks, see asyncio_set_watermarks()
+  size_t af_sendq_high;
+  size_t af_sendq_low;
+  asyncio_writable_cb_t *af_writable;
+  void *af_writable_opaque;
+  int af_writable_armed;
+
+  // Chunk for reads that don't fit in af_recvq's tail space
+  void *af_read_spare;
+  size_t af_read_spare_size;
+  size_t af_read_size;
+
   char *af_hostname;
 
+  uint64_t af_bytes_in;
+  uint64_t af_bytes_out;
+  size_t af_sendq_peak;
+
   pthread_mutex_t af_sendq_mutex;
   pthread_cond_t af_sendq_cond;
 
   atomic_t af_refcount;
   int af_fd;
   int af_epoll_flags;
+  int af_et_ready; // Edges seen while not interested, edge triggered only
   uint16_t af_port;
 
   uint16_t af_flags;
 
   uint8_t af_pending_shutdown;
+  uint8_t af_dgram_no_gso;
   int af_pending_error;
 
 #if defined(WITH_OPENSSL)
   int af_ssl_established;
   int af_ssl_read_status;
   int af_ssl_write_status;
+  int af_ktls_send; // Kernel encrypts, use the plain write path
   SSL *af_ssl;
+  char *af_ssl_session_key; // hostname:port for client session reuse
+  int64_t af_ssl_handshake_cpu;
+#endif
+
+#ifdef WITH_IO_URING
+  uint8_t af_uring_in;     // Request kind used for EPOLLIN
+  uint8_t af_uring_live;   // Requests (1 << kind) active in the kernel
+  uint8_t af_uring_cancel; // Requests being cancelled
+  uint8_t af_uring_eof;    // Don't rearm recv
+  int af_uring_poll_mask;  // Events of the active poll request
+  int af_uring_dirty;      // On the loop's dirty list
+  struct asyncio_fd *af_uring_dirty_next;
 #endif
 };
 
 
 
 
-#define TW_TIME_SHIFT  18
-#define TW_SLOTS 65536
-#define TW_SLOT_MASK (TW_SLOTS - 1)
+#ifdef IOV_MAX
+#define ASYNCIO_IOV_MAX IOV_MAX
+#else
+#define ASYNCIO_IOV_MAX 1024
+#endif
+
+#define ASYNCIO_SSL_RECORD_SIZE 16384
 
-static struct asyncio_timer_list timerwheel[TW_SLOTS];
-static int                timerwheel_read_pos;
+#define ASYNCIO_SENDFILE_CHUNK (1024 * 1024 * 1024)
 
-static int asyncio_pipe[2];
-static asyncio_fd_t *pipe_af;
-static int epfd;
+#define ASYNCIO_ACCEPT_BUDGET 64       // Connections per poll event
+#define ASYNCIO_ACCEPT_BACKOFF 100000  // Pause on EMFILE etc (s)
 
-static int asyncio_task_worker;
-static struct asyncio_worker_list asyncio_workers;
+#define ASYNCIO_READ_SIZE_MIN 4096
+#define ASYNCIO_READ_SIZE_MAX (256 * 1024)
 
+/**
+ * Timers live in a hierarchical wheel. Level 0 slots are one tick
+ * (64us) wide and each level above covers the full span of the one
+ * below. Timers are cascaded down when their slot comes up so each
+ * timer is touched at most TW_LEVELS times, and per-level bitmaps let
+ * the loop jump straight to the next populated slot.
+ */
+#define TW_TICK_SHIFT  6
+#define TW_LEVEL_BITS  8
+#define TW_LEVELS      4
+#define TW_LEVEL_SLOTS (1 << TW_LEVEL_BITS)
+#define TW_LEVEL_MASK  (TW_LEVEL_SLOTS - 1)
+#define TW_MAX_DELTA   ((1ULL << (TW_LEVEL_BITS * TW_LEVELS)) - 1)
+#define TW_NEVER       UINT64_MAX
 
-static pthread_t asyncio_tid;
+static int asyncio_task_worker;
+static int asyncio_timer_worker;
+static int asyncio_edge_triggered;
+#ifdef WITH_IO_URING
+static int asyncio_uring_worker;
+static int asyncio_use_uring;
+#endif
 
 /**
- *
+ * Workers are identified by a bit in the per-loop pending mask
  */
-typedef struct asyncio_worker {
-  LIST_ENTRY(asyncio_worker) link;
-  void (*fn)(void);
-  int id;
-  int pending;
-} asyncio_worker_t;
+#define ASYNCIO_MAX_WORKERS 64
 
+static void (*asyncio_workers[ASYNCIO_MAX_WORKERS])(void);
+static int asyncio_num_workers;
 static pthread_mutex_t asyncio_worker_mutex;
 
 /**
- *
+ * Completion for asyncio_run_task_blocking(). Lives on the caller's stack
+ */
+typedef struct asyncio_task_waiter {
+  int atw_done;
+#ifndef __linux__
+  pthread_mutex_t atw_mutex;
+  pthread_cond_t atw_cond;
+#endif
+} asyncio_task_waiter_t;
+
+/**
+ * Tasks are posted to a bounded ring (Vyukov style, multi producer,
+ * single consumer). A slot is free for position N when its sequence is
+ * N and holds a task once its sequence is N + 1. If the ring is full
+ * tasks are malloced onto a mutex protected overflow queue, and further
+ * tasks go there as well until it has been drained so that tasks from
+ * one thread still run in order.
  */
+#define ASYNCIO_TASK_RING_SIZE 1024
+#define ASYNCIO_TASK_RING_MASK (ASYNCIO_TASK_RING_SIZE - 1)
+
+typedef struct asyncio_task_slot {
+  uint64_t ats_seq;
+  void (*ats_fn)(void *aux);
+  void *ats_aux;
+  asyncio_task_waiter_t *ats_waiter;
+} asyncio_task_slot_t;
+
 typedef struct asyncio_task {
   TAILQ_ENTRY(asyncio_task) at_link;
   void (*at_fn)(void *aux);
   void *at_aux;
-  int at_block;
+  asyncio_task_waiter_t *at_waiter;
 } asyncio_task_t;
 
-static pthread_mutex_t asyncio_task_mutex;
-static pthread_cond_t asyncio_task_cond;
-static TAILQ_HEAD(, asyncio_task) asyncio_tasks;
+TAILQ_HEAD(asyncio_task_queue, asyncio_task);
+
+
+/**
+ * Each loop runs on its own thread with its own poll set, timers and
+ * task queue. An asyncio_fd_t is pinned to the loop it was created on
+ * so all callbacks for a given fd are invoked from a single thread.
+ */
+struct asyncio_loop {
+  pthread_t al_tid;
+  int al_id;
+  int al_epfd;
+  int al_wakeup_fd[2]; // Same eventfd for both on Linux
+  asyncio_fd_t *al_wakeup_af;
+  uint64_t al_workers_pending; // Bitmask of workers to run
+
+  struct asyncio_timer_list al_tw_slots[TW_LEVELS][TW_LEVEL_SLOTS];
+  uint64_t al_tw_bitmap[TW_LEVELS][TW_LEVEL_SLOTS / 64];
+  uint64_t al_tw_tick; // Next tick to process
+  uint64_t al_tw_next; // Next tick with work, as of last tw_step()
+  asyncio_timer_t *al_timer_cmds; // Lock-free stack of cross thread requests
+#ifdef __linux__
+  int al_timerfd;
+  uint64_t al_timerfd_tick;
+#endif
+
+#ifdef WITH_IO_URING
+  asyncio_uring_t *al_uring; // NULL if using epoll
+#endif
+
+  asyncio_task_slot_t *al_task_ring;
+  uint64_t al_task_head;  // Only touched by the loop thread
+  uint64_t al_task_tail;
+  int al_task_overflowed; // Number of tasks on al_task_overflow
+  pthread_mutex_t al_task_mutex;
+  struct asyncio_task_queue al_task_overflow;
+
+  // Only written by the loop thread, see asyncio_get_loop_stats()
+  asyncio_loop_stats_t al_stats;
+  struct asyncio_dgram_pool *al_dgram_pool;
+  int64_t al_stats_wake; // When we returned from the last wait
+  int64_t al_stats_wait; // When we started waiting
+};
+
+static asyncio_loop_t **asyncio_loops;
+static int asyncio_num_loops;
+static atomic_t asyncio_loop_rr;
+
+static __thread asyncio_loop_t *asyncio_current_loop;
+
+/**
+ * Accepted sockets inherit keepalive options from the listener on Linux
+ * and are already non-blocking, so asyncio_stream() can skip the setup
+ * for the fd handed to the accept callback.
+ */
+static __thread int asyncio_accepted_fd = -1;
+
+static void asyncio_loop_run_task(asyncio_loop_t *al,
+                                  void (*fn)(void *aux), void *aux,
+                                  int block);
+
+#if defined(WITH_OPENSSL)
+static asyncio_tls_stats_t asyncio_tls_stats;
+
+static void ssl_session_resume(asyncio_fd_t *af, const char *hostname);
+#endif
+
+
+/**
+ * Pick the loop for a new fd. Fds created from a loop thread (typically
+ * from an accept callback) stay on that loop, everything else is
+ * spread round-robin.
+ */
+static asyncio_loop_t *
+asyncio_pick_loop(void)
+{
+  if(asyncio_current_loop != NULL)
+    return asyncio_current_loop;
+  if(asyncio_num_loops == 1)
+    return asyncio_loops[0];
+  const unsigned int n = atomic_add_and_fetch(&asyncio_loop_rr, 1);
+  return asyncio_loops[n % asyncio_num_loops];
+}
 
 
 static void
@@ -221,26 +461,55 @@ setup_tcp_socket(int fd)
 
 
 /**
- *
+ * Mark worker as pending on the loop. Only the thread that makes the
+ * pending mask non-empty needs to signal the loop, everyone else
+ * piggybacks on that wakeup.
  */
-void
-asyncio_wakeup_worker(int id)
+static void
+asyncio_loop_wakeup(asyncio_loop_t *al, int id)
 {
-  char x = id;
+  const uint64_t prev = __atomic_fetch_or(&al->al_workers_pending,
+                                          1ULL << id, __ATOMIC_SEQ_CST);
+  if(prev)
+    return;
+
+#ifdef __linux__
+  const uint64_t one = 1;
+  const void *x = &one;
+  const size_t len = sizeof(one);
+#else
+  const char one = 1;
+  const void *x = &one;
+  const size_t len = 1;
+#endif
+
   while(1) {
-    int r = write(asyncio_pipe[1], &x, 1);
-    if(r == 1)
+    int r = write(al->al_wakeup_fd[1], x, len);
+    if(r == len)
       return;
 
     if(r == -1 && errno == EINTR)
       continue;
 
-    fprintf(stderr, "Pipe problems\n");
+    if(r == -1 && errno == EAGAIN)
+      return; // Already signalled
+
+    fprintf(stderr, "Wakeup problems\n");
     break;
   }
 }
 
 
+/**
+ *
+ */
+void
+asyncio_wakeup_worker(int id)
+{
+  asyncio_loop_wakeup(asyncio_loops[0], id);
+}
+
+
 /**
  *
  */
@@ -251,6 +520,8 @@ asyncio_timer_init(asyncio_timer_t *at, void (*fn)(void *opaque),
   at->at_fn = fn;
   at->at_opaque = opaque;
   at->at_expire = 0;
+  at->at_loop = asyncio_current_loop ?: asyncio_loops[0];
+  at->at_cmd_queued = 0;
 }
 
 
@@ -275,150 +546,230 @@ asyncio_get_monotime(void)
 /**
  *
  */
-void
-asyncio_timer_arm_delta(asyncio_timer_t *at, uint64_t delta)
+static void
+stats_hist_add(uint64_t *hist, uint64_t v)
 {
-  assert(pthread_self() == asyncio_tid);
+  const int b = v ? 64 - __builtin_clzll(v) : 0;
+  hist[MIN(b, ASYNCIO_STATS_BUCKETS - 1)]++;
+}
 
-  if(at->at_expire)
-    LIST_REMOVE(at, at_link);
 
-  const int64_t now = asyncio_get_monotime();
+/**
+ * Keep track of the slowest callbacks. Each function only gets one
+ * entry so a single slow handler can't push out everything else
+ */
+static void
+loop_stats_callback(asyncio_loop_t *al, void *fn, int64_t us)
+{
+  asyncio_loop_stats_t *st = &al->al_stats;
+  int i;
 
-  int64_t expire = now + delta;
-  if(expire < now)
-    expire = now;
+  st->callbacks++;
 
-  const int slot = ((expire >> TW_TIME_SHIFT) + 1) & TW_SLOT_MASK;
+  if(us <= (int64_t)st->slowest[ASYNCIO_STATS_SLOWEST - 1].us)
+    return;
 
-  at->at_expire = expire;
-  LIST_INSERT_HEAD(&timerwheel[slot], at, at_link);
+  for(i = 0; i < ASYNCIO_STATS_SLOWEST - 1; i++)
+    if(st->slowest[i].fn == fn)
+      break;
+
+  if(us <= (int64_t)st->slowest[i].us)
+    return;
+
+  // Bubble the entry up to its sorted position
+  for(; i > 0 && (int64_t)st->slowest[i - 1].us < us; i--)
+    st->slowest[i] = st->slowest[i - 1];
+  st->slowest[i].fn = fn;
+  st->slowest[i].us = us;
 }
 
 
 /**
  *
  */
-void
-asyncio_timer_disarm(asyncio_timer_t *at)
+static void
+loop_stats_wait_begin(asyncio_loop_t *al)
 {
-  assert(pthread_self() == asyncio_tid);
-
-  if(at->at_expire) {
-    LIST_REMOVE(at, at_link);
-    at->at_expire = 0;
+  const int64_t now = asyncio_get_monotime();
+  if(al->al_stats_wake) {
+    const int64_t busy = MAX(now - al->al_stats_wake, 0);
+    al->al_stats.busy_us += busy;
+    stats_hist_add(al->al_stats.busy_hist, busy);
   }
+  al->al_stats_wait = now;
 }
 
-#ifdef __linux__
+
 /**
  *
  */
 static void
-mod_poll_flags(asyncio_fd_t *af, int set, int clr)
+loop_stats_wait_end(asyncio_loop_t *al, int events)
 {
-  struct epoll_event e;
-  int f = (af->af_epoll_flags | set) & ~clr;
+  asyncio_loop_stats_t *st = &al->al_stats;
+  const int64_t now = asyncio_get_monotime();
+  const int64_t wait = MAX(now - al->al_stats_wait, 0);
+
+  st->iterations++;
+  st->wait_us += wait;
+  stats_hist_add(st->wait_hist, wait);
+  if(events > 0) {
+    st->events += events;
+    stats_hist_add(st->events_hist, events);
+  }
+  al->al_stats_wake = now;
+}
 
-  if(f == af->af_epoll_flags)
-    return;
 
-  assert(af->af_fd != -1);
+/**
+ * The function we attribute time spent in an fd callback to
+ */
+static void *
+af_stats_fn(const asyncio_fd_t *af)
+{
+  if(af->af_bytes_avail != NULL)
+    return af->af_bytes_avail;
+  if(af->af_accept != NULL)
+    return af->af_accept;
+  return af->af_pollin;
+}
 
 
-  e.data.ptr = af;
-  e.events = f;
+/**
+ * CPU time consumed by the calling thread
+ */
+static int64_t __attribute__((unused))
+thread_cpu_time(void)
+{
+  struct timespec tv;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &tv);
+  return (int64_t)tv.tv_sec * 1000000LL + (tv.tv_nsec / 1000);
+}
 
-  int op;
-  if(!f) {
-    op =  EPOLL_CTL_DEL;
-  } else if(!af->af_epoll_flags) {
-    op =  EPOLL_CTL_ADD;
-  } else {
-    op =  EPOLL_CTL_MOD;
-  }
 
-  int r = epoll_ctl(epfd, op, af->af_fd, &e);
+/**
+ * Tick at which a timer is due. Rounded up so timers never fire early
+ */
+static uint64_t
+tw_expire_tick(int64_t expire)
+{
+  return (expire + (1 << TW_TICK_SHIFT) - 1) >> TW_TICK_SHIFT;
+}
 
-  if(r) {
-    fprintf(stderr, "epoll_ctl(%d, %d, %x) -- %s\n",
-	    op, af->af_fd, e.events, strerror(errno));
+
+/**
+ *
+ */
+static void
+tw_insert(asyncio_loop_t *al, asyncio_timer_t *at)
+{
+  uint64_t tick = tw_expire_tick(at->at_expire);
+  if(tick < al->al_tw_tick)
+    tick = al->al_tw_tick;
+
+  uint64_t delta = tick - al->al_tw_tick;
+  if(delta > TW_MAX_DELTA) {
+    // Beyond the top level, parked and reinserted when it comes around
+    delta = TW_MAX_DELTA;
+    tick = al->al_tw_tick + delta;
   }
 
-  af->af_epoll_flags = f;
-}
-#endif
+  int level = 0;
+  while(delta >= TW_LEVEL_SLOTS) {
+    delta >>= TW_LEVEL_BITS;
+    level++;
+  }
 
-#ifdef __APPLE__
+  const int slot = (tick >> (level * TW_LEVEL_BITS)) & TW_LEVEL_MASK;
+  LIST_INSERT_HEAD(&al->al_tw_slots[level][slot], at, at_link);
+  al->al_tw_bitmap[level][slot >> 6] |= 1ULL << (slot & 63);
+}
 
-#define EPOLLIN  0x1
-#define EPOLLOUT 0x2
-#define MSG_NOSIGNAL 0
-#define MSG_MORE 0
 
 /**
- *
+ * Must be called on the owning loop. An expire time of 0 disarms
  */
 static void
-mod_poll_flags(asyncio_fd_t *af, int set, int clr)
+tw_set(asyncio_loop_t *al, asyncio_timer_t *at, int64_t expire)
 {
-  set &= ~af->af_epoll_flags;
-  clr &=  af->af_epoll_flags;
-
-  assert(af->af_fd != -1);
+  if(at->at_expire)
+    LIST_REMOVE(at, at_link);
 
-  struct kevent changes[2];
-  int num_changes = 0;
+  at->at_expire = expire;
+  if(expire)
+    tw_insert(al, at);
+}
 
-  if(set & EPOLLIN) {
-    EV_SET(&changes[0], af->af_fd, EVFILT_READ, EV_ADD, 0, 0, af);
-    num_changes++;
-  } else if(clr & EPOLLIN) {
-    EV_SET(&changes[0], af->af_fd, EVFILT_READ, EV_DELETE, 0, 0, af);
-    num_changes++;
-  }
 
-  if(set & EPOLLOUT) {
-    EV_SET(&changes[num_changes], af->af_fd, EVFILT_WRITE, EV_ADD, 0, 0, af);
-    num_changes++;
-  } else if(clr & EPOLLOUT) {
-    EV_SET(&changes[num_changes], af->af_fd, EVFILT_WRITE, EV_DELETE, 0, 0, af);
-    num_changes++;
+/**
+ * Queue a request for the owning loop. Only the most recent request is
+ * kept, so a timer is on the queue at most once
+ */
+static void
+asyncio_timer_post(asyncio_timer_t *at, int64_t expire)
+{
+  asyncio_loop_t *al = at->at_loop;
+
+  __atomic_store_n(&at->at_cmd_expire, expire, __ATOMIC_SEQ_CST);
+
+  if(!__atomic_exchange_n(&at->at_cmd_queued, 1, __ATOMIC_SEQ_CST)) {
+    asyncio_timer_t *head = __atomic_load_n(&al->al_timer_cmds,
+                                            __ATOMIC_RELAXED);
+    do {
+      at->at_cmd_next = head;
+    } while(!__atomic_compare_exchange_n(&al->al_timer_cmds, &head, at, 1,
+                                         __ATOMIC_SEQ_CST,
+                                         __ATOMIC_RELAXED));
   }
 
-  struct timespec instant = {};
-  int r = kevent(epfd, changes, num_changes, NULL, 0, &instant);
-  if(r == -1)
-    perror("kevent() modify");
+  if(expire == 0)
+    return;
 
-  af->af_epoll_flags = (af->af_epoll_flags | set) & ~clr;
+  // The loop rechecks the queue after publishing its next wakeup, so we
+  // only need to kick it if this timer is due before that
+  if(tw_expire_tick(expire) < __atomic_load_n(&al->al_tw_next,
+                                               __ATOMIC_SEQ_CST))
+    asyncio_loop_wakeup(al, asyncio_timer_worker);
 }
-#endif
 
 
 /**
  *
  */
-static asyncio_fd_t *
-asyncio_fd_create(int fd, int initial_poll_flags)
+static void
+asyncio_timer_drain(asyncio_loop_t *al)
 {
-  asyncio_fd_t *af = calloc(1, sizeof(asyncio_fd_t));
-  af->af_fd = fd;
-  atomic_set(&af->af_refcount, 1);
-  mbuf_init(&af->af_sendq);
-  mbuf_init(&af->af_recvq);
-  mod_poll_flags(af, initial_poll_flags, 0);
-  return af;
+  asyncio_timer_t *at, *next;
+
+  at = __atomic_exchange_n(&al->al_timer_cmds, NULL, __ATOMIC_SEQ_CST);
+  for(; at != NULL; at = next) {
+    next = at->at_cmd_next;
+    // Clear before reading so a concurrent request is either seen here
+    // or queued again
+    __atomic_store_n(&at->at_cmd_queued, 0, __ATOMIC_SEQ_CST);
+    tw_set(al, at, __atomic_load_n(&at->at_cmd_expire, __ATOMIC_SEQ_CST));
+  }
 }
 
 
 /**
  *
  */
-void
-asyncio_fd_retain(asyncio_fd_t *af)
+static void
+asyncio_timer_set(asyncio_timer_t *at, int64_t expire)
 {
-  atomic_inc(&af->af_refcount);
+  asyncio_loop_t *al = asyncio_current_loop;
+
+  if(at->at_loop != al) {
+    asyncio_timer_post(at, expire);
+    return;
+  }
+
+  // Don't let a stale request from another thread undo this one
+  if(__atomic_load_n(&at->at_cmd_queued, __ATOMIC_SEQ_CST))
+    __atomic_store_n(&at->at_cmd_expire, expire, __ATOMIC_SEQ_CST);
+
+  tw_set(al, at, expire);
 }
 
 
@@ -426,653 +777,3251 @@ asyncio_fd_retain(asyncio_fd_t *af)
  *
  */
 void
-asyncio_fd_release(asyncio_fd_t *af)
+asyncio_timer_arm_delta(asyncio_timer_t *at, uint64_t delta)
 {
-  if(atomic_dec(&af->af_refcount))
-    return;
-
-  assert(af->af_fd == -1);
+  const int64_t now = asyncio_get_monotime();
 
-  if(af->af_flags & ASYNCIO_FLAG_THREAD_SAFE) {
-    pthread_mutex_destroy(&af->af_sendq_mutex);
-    pthread_cond_destroy(&af->af_sendq_cond);
-  }
+  int64_t expire = now + delta;
+  if(expire < now)
+    expire = now;
 
-  mbuf_clear(&af->af_sendq);
-  mbuf_clear(&af->af_recvq);
-  free(af->af_hostname);
-  free(af);
+  asyncio_timer_set(at, expire);
 }
 
 
-
 /**
  *
  */
-static int
-do_write_locked(asyncio_fd_t *af)
+void
+asyncio_timer_disarm(asyncio_timer_t *at)
 {
-  char tmp[1024];
-
-  while(1) {
-    int avail = mbuf_peek(&af->af_sendq, tmp, sizeof(tmp));
-    if(avail == 0) {
-      if(af->af_pending_shutdown) {
-        shutdown(af->af_fd, 2);
-      }
-      // Nothing more to send
-      mod_poll_flags(af, 0, EPOLLOUT);
-      return 0;
-    }
+  asyncio_timer_set(at, 0);
+}
 
-    int r = send(af->af_fd, tmp, avail, MSG_NOSIGNAL);
-    if(r == 0)
-      break;
+#ifdef WITH_IO_URING
+/**
+ * Optional io_uring backend, enabled with "asyncio.backend": "io_uring".
+ *
+ * Readiness is tracked with one-shot POLL_ADD requests that are rearmed
+ * after each completion, giving the same level-triggered behaviour as
+ * epoll. Listening sockets use multishot accept and plain TCP streams
+ * use multishot recv into a ring of provided buffers which are handed
+ * over to af_recvq as mbuf chunks. Everything queued while dispatching
+ * goes to the kernel with the next wait, in a single io_uring_enter().
+ *
+ * Only the owning loop thread touches the rings. Poll flag changes from
+ * other threads are put on a dirty list and applied by the loop.
+ */
 
-    if(r == -1 && (errno == EAGAIN || errno == EINTR))
-      break;
+#define URING_ENTRIES    1024
+#define URING_BUF_COUNT  256
+#define URING_BUF_SIZE   16384
+#define URING_BUF_GROUP  0
+
+// Request kinds, stored in the low bits of user_data
+#define URING_OP_POLL    0
+#define URING_OP_RECV    1
+#define URING_OP_ACCEPT  2
+#define URING_OP_IGNORE  3
+#define URING_OP_MASK    3
+
+struct asyncio_uring {
+  int au_fd;
+
+  unsigned *au_sq_head;
+  unsigned *au_sq_tail;
+  unsigned au_sq_mask;
+  unsigned au_sq_entries;
+  unsigned au_sq_local_tail;
+  struct io_uring_sqe *au_sqes;
+
+  unsigned *au_cq_head;
+  unsigned *au_cq_tail;
+  unsigned au_cq_mask;
+  struct io_uring_cqe *au_cqes;
+
+  struct io_uring_buf_ring *au_bufring;
+  uint16_t au_bufring_tail;
+  void *au_bufs[URING_BUF_COUNT];
+
+  asyncio_fd_t *au_dirty;
+};
 
-    if(r == -1) {
-      mod_poll_flags(af, 0, EPOLLOUT);
-      return errno;
-    }
 
-    mbuf_drop(&af->af_sendq, r);
+/**
+ * Hand buffer 'bid' (a new one if buf is NULL) to the kernel
+ */
+static void
+uring_buf_provide(asyncio_uring_t *au, int bid, void *buf)
+{
+  if(buf == NULL)
+    buf = malloc(URING_BUF_SIZE);
+  au->au_bufs[bid] = buf;
+
+  struct io_uring_buf *b =
+    &au->au_bufring->bufs[au->au_bufring_tail & (URING_BUF_COUNT - 1)];
+  b->addr = (uintptr_t)buf;
+  b->len = URING_BUF_SIZE;
+  b->bid = bid;
+  au->au_bufring_tail++;
+  __atomic_store_n(&au->au_bufring->tail, au->au_bufring_tail,
+                   __ATOMIC_RELEASE);
+}
 
-    if(af->af_flags & ASYNCIO_FLAG_THREAD_SAFE)
-      pthread_cond_signal(&af->af_sendq_cond);
 
-    if(r != avail)
-      break;
+/**
+ *
+ */
+static asyncio_uring_t *
+uring_create(void)
+{
+  struct io_uring_params p;
+  memset(&p, 0, sizeof(p));
+  p.flags = IORING_SETUP_COOP_TASKRUN;
+
+  int fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+  if(fd == -1 && errno == EINVAL) {
+    memset(&p, 0, sizeof(p));
+    fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
   }
+  if(fd == -1)
+    return NULL;
 
-  mod_poll_flags(af, EPOLLOUT, 0);
-  return 0;
-}
+  const unsigned features =
+    IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP | IORING_FEAT_EXT_ARG;
+  if((p.features & features) != features) {
+    close(fd);
+    errno = ENOTSUP;
+    return NULL;
+  }
+
+  const size_t sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  const size_t cq_size =
+    p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  void *ring = mmap(NULL, MAX(sq_size, cq_size), PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+  if(ring == MAP_FAILED) {
+    close(fd);
+    return NULL;
+  }
+
+  void *sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+                    PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                    fd, IORING_OFF_SQES);
+  if(sqes == MAP_FAILED) {
+    close(fd);
+    return NULL;
+  }
+
+  void *bufring = mmap(NULL, URING_BUF_COUNT * sizeof(struct io_uring_buf),
+                       PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+                       -1, 0);
+  if(bufring == MAP_FAILED) {
+    close(fd);
+    return NULL;
+  }
+
+  struct io_uring_buf_reg reg = {
+    .ring_addr = (uintptr_t)bufring,
+    .ring_entries = URING_BUF_COUNT,
+    .bgid = URING_BUF_GROUP,
+  };
+  if(syscall(__NR_io_uring_register, fd, IORING_REGISTER_PBUF_RING,
+             &reg, 1)) {
+    close(fd);
+    return NULL;
+  }
+
+  asyncio_uring_t *au = calloc(1, sizeof(asyncio_uring_t));
+  au->au_fd = fd;
+
+  au->au_sq_head = ring + p.sq_off.head;
+  au->au_sq_tail = ring + p.sq_off.tail;
+  au->au_sq_mask = *(unsigned *)(ring + p.sq_off.ring_mask);
+  au->au_sq_entries = *(unsigned *)(ring + p.sq_off.ring_entries);
+  au->au_sq_local_tail = *au->au_sq_tail;
+  au->au_sqes = sqes;
 
+  // SQ entries are always used in order
+  unsigned *array = ring + p.sq_off.array;
+  for(unsigned i = 0; i < au->au_sq_entries; i++)
+    array[i] = i;
+
+  au->au_cq_head = ring + p.cq_off.head;
+  au->au_cq_tail = ring + p.cq_off.tail;
+  au->au_cq_mask = *(unsigned *)(ring + p.cq_off.ring_mask);
+  au->au_cqes = ring + p.cq_off.cqes;
+
+  au->au_bufring = bufring;
+  for(int i = 0; i < URING_BUF_COUNT; i++)
+    uring_buf_provide(au, i, NULL);
+
+  return au;
+}
 
 
 /**
- *
+ * Submit queued SQEs, optionally waiting for completions
  */
-int
-asyncio_wait_send_buffer(asyncio_fd_t *af, int size)
+static int
+uring_enter(asyncio_uring_t *au, unsigned min_complete, unsigned flags,
+            void *arg, size_t argsz)
 {
-  int r = 0;
-  pthread_mutex_lock(&af->af_sendq_mutex);
-
-  while(1) {
-    if(af->af_pending_error) {
-      r = af->af_pending_error;
-      break;
-    }
+  __atomic_store_n(au->au_sq_tail, au->au_sq_local_tail, __ATOMIC_RELEASE);
+  const unsigned to_submit = au->au_sq_local_tail -
+    __atomic_load_n(au->au_sq_head, __ATOMIC_ACQUIRE);
 
-    if(size > af->af_sendq.mq_size)
-      break;
+  if(to_submit == 0 && !(flags & IORING_ENTER_GETEVENTS))
+    return 0;
 
-    pthread_cond_wait(&af->af_sendq_cond, &af->af_sendq_mutex);
-  }
-  pthread_mutex_unlock(&af->af_sendq_mutex);
-  return r;
+  return syscall(__NR_io_uring_enter, au->au_fd, to_submit, min_complete,
+                 flags, arg, argsz);
 }
 
 
 /**
  *
  */
-static void
-do_error(asyncio_fd_t *af, int error)
+static struct io_uring_sqe *
+uring_get_sqe(asyncio_uring_t *au)
 {
-  if(af->af_flags & ASYNCIO_FLAG_THREAD_SAFE) {
-    pthread_mutex_lock(&af->af_sendq_mutex);
-    af->af_pending_error = error;
-    pthread_cond_signal(&af->af_sendq_cond);
-    pthread_mutex_unlock(&af->af_sendq_mutex);
+  while(au->au_sq_local_tail -
+        __atomic_load_n(au->au_sq_head, __ATOMIC_ACQUIRE) >=
+        au->au_sq_entries) {
+    if(uring_enter(au, 0, 0, NULL, 0) == -1 && errno != EINTR) {
+      perror("io_uring_enter");
+      usleep(1000);
+    }
   }
-  if(af->af_error != NULL)
-    af->af_error(af->af_opaque, error);
-  af->af_error = NULL;
+
+  struct io_uring_sqe *sqe =
+    &au->au_sqes[au->au_sq_local_tail & au->au_sq_mask];
+  au->au_sq_local_tail++;
+  memset(sqe, 0, sizeof(struct io_uring_sqe));
+  return sqe;
 }
 
 
 /**
  *
  */
-static void
-do_write_unlocked(asyncio_fd_t *af)
+static uint64_t
+uring_user_data(asyncio_fd_t *af, int kind)
 {
-  af_lock(af);
-  int err = af->af_locked_write(af);
-  af_unlock(af);
-  if(err)
-    do_error(af, err);
+  return (uintptr_t)af | kind;
 }
 
 
 /**
- *
+ * Each request in the kernel holds a reference to the fd
  */
 static void
-do_read(asyncio_fd_t *af)
+uring_add(asyncio_uring_t *au, asyncio_fd_t *af, int kind, int poll_mask)
 {
-  char tmp[1024];
-  while(1) {
-    int r = read(af->af_fd, tmp, sizeof(tmp));
-    if(r == 0) {
-      if(af->af_recvq.mq_size)
-        af->af_bytes_avail(af->af_opaque, &af->af_recvq);
-      do_error(af, ECONNRESET);
-      return;
-    }
-
-    if(r == -1 && (errno == EAGAIN || errno == EINTR))
-      break;
+  struct io_uring_sqe *sqe = uring_get_sqe(au);
+  sqe->fd = af->af_fd;
+  sqe->user_data = uring_user_data(af, kind);
+
+  switch(kind) {
+  case URING_OP_POLL:
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->poll32_events = poll_mask;
+    af->af_uring_poll_mask = poll_mask;
+    break;
 
-    if(r == -1) {
-      do_error(af, errno);
-      return;
-    }
+  case URING_OP_RECV:
+    sqe->opcode = IORING_OP_RECV;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BUF_GROUP;
+    break;
 
-    mbuf_append(&af->af_recvq, tmp, r);
+  case URING_OP_ACCEPT:
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    break;
   }
 
-  af->af_bytes_avail(af->af_opaque, &af->af_recvq);
+  af->af_uring_live |= 1 << kind;
+  atomic_inc(&af->af_refcount);
 }
 
 
-
-#if defined(WITH_OPENSSL)
-static void __attribute__((unused))
-ssldump(asyncio_fd_t *af)
+/**
+ *
+ */
+static void
+uring_cancel(asyncio_uring_t *au, asyncio_fd_t *af, int kind)
 {
-  unsigned long e;
-  char errbuf[512];
-  while((e = ERR_get_error()) != 0) {
-    ERR_error_string_n(e, errbuf, sizeof(errbuf));
-      trace(LOG_ERR, "SSL: %s", errbuf);
-  }
+  struct io_uring_sqe *sqe = uring_get_sqe(au);
+  sqe->opcode = IORING_OP_ASYNC_CANCEL;
+  sqe->fd = -1;
+  sqe->addr = uring_user_data(af, kind);
+  sqe->user_data = URING_OP_IGNORE;
+  af->af_uring_cancel |= 1 << kind;
 }
 
 
+/**
+ *
+ */
+static void
+uring_poll_update(asyncio_uring_t *au, asyncio_fd_t *af, int poll_mask)
+{
+  struct io_uring_sqe *sqe = uring_get_sqe(au);
+  sqe->opcode = IORING_OP_POLL_REMOVE;
+  sqe->fd = -1;
+  sqe->addr = uring_user_data(af, URING_OP_POLL);
+  sqe->len = IORING_POLL_UPDATE_EVENTS;
+  sqe->poll32_events = poll_mask;
+  sqe->user_data = URING_OP_IGNORE;
+  af->af_uring_poll_mask = poll_mask;
+}
+
 
 /**
  *
  */
-static int
-verify_hostname(const char *hostname, X509 *cert, char *errbuf, size_t errlen)
+static void
+uring_sync_kind(asyncio_uring_t *au, asyncio_fd_t *af, int kind, int want)
 {
-  int i;
-  /* domainname is the "domain" we wan't to access (actually hostname
-   * with first part of the DNS name removed) */
-  const char *domainname = strchr(hostname, '.');
-  if(domainname != NULL) {
-      domainname++;
-      if(strlen(domainname) == 0)
-        domainname = NULL;
+  const int bit = 1 << kind;
+
+  if(af->af_uring_cancel & bit)
+    return; // Reevaluated once the cancelled request completes
+
+  if(!(af->af_uring_live & bit)) {
+    if(want)
+      uring_add(au, af, kind, want);
+  } else if(!want) {
+    uring_cancel(au, af, kind);
+  } else if(kind == URING_OP_POLL && want != af->af_uring_poll_mask) {
+    uring_poll_update(au, af, want);
   }
+}
 
 
-  // First check commonName
+/**
+ * Bring requests in the kernel in line with af_epoll_flags
+ */
+static void
+uring_sync(asyncio_uring_t *au, asyncio_fd_t *af)
+{
+  const int flags = af->af_fd == -1 ? 0 :
+    __atomic_load_n(&af->af_epoll_flags, __ATOMIC_SEQ_CST);
 
-  X509_NAME *subjectName;
-  char commonName[256];
+  int poll_mask = flags & EPOLLOUT;
+  int want_in = 0;
 
-  subjectName = X509_get_subject_name(cert);
-  if(X509_NAME_get_text_by_NID(subjectName, NID_commonName,
-                               commonName, sizeof(commonName)) != -1) {
-    if(!strcmp(commonName, hostname))
-      return 0;
-  }
+  if(af->af_uring_in == URING_OP_POLL)
+    poll_mask |= flags & EPOLLIN;
+  else
+    want_in = flags & EPOLLIN && !af->af_uring_eof;
 
-  // Then check altNames
+  uring_sync_kind(au, af, URING_OP_POLL, poll_mask);
+  if(af->af_uring_in != URING_OP_POLL)
+    uring_sync_kind(au, af, af->af_uring_in, want_in);
+}
 
-  GENERAL_NAMES *names = X509_get_ext_d2i( cert, NID_subject_alt_name, 0, 0);
-  if(names == NULL) {
-    snprintf(errbuf, errlen, "SSL: No subjectAltName extension");
-    return -1;
-  }
 
-  const int num_names = sk_GENERAL_NAME_num(names);
+/**
+ * Poll flags changed on a thread other than the owning loop
+ */
+static void
+uring_mark_dirty(asyncio_loop_t *al, asyncio_fd_t *af)
+{
+  asyncio_uring_t *au = al->al_uring;
 
-  for(i = 0; i < num_names; ++i ) {
-    GENERAL_NAME *name = sk_GENERAL_NAME_value(names, i);
-    unsigned char *dns;
-    int match;
+  if(__atomic_exchange_n(&af->af_uring_dirty, 1, __ATOMIC_SEQ_CST))
+    return;
 
-    if(name->type != GEN_DNS)
-      continue;
+  atomic_inc(&af->af_refcount);
 
-    ASN1_STRING_to_UTF8(&dns, name->d.dNSName);
-    if(dns[0] == '*' && dns[1] == '.') {
-      match = domainname != NULL && !strcasecmp((char *)dns+2, domainname);
-    } else {
-      match = !strcasecmp((char *)dns, hostname);
-    }
+  asyncio_fd_t *head = __atomic_load_n(&au->au_dirty, __ATOMIC_RELAXED);
+  do {
+    af->af_uring_dirty_next = head;
+  } while(!__atomic_compare_exchange_n(&au->au_dirty, &head, af, 1,
+                                       __ATOMIC_SEQ_CST, __ATOMIC_RELAXED));
 
-    OPENSSL_free(dns);
-    if(match)
-      return 0;
+  // The loop drains the whole list once woken
+  if(head == NULL)
+    asyncio_loop_wakeup(al, asyncio_uring_worker);
+}
+
+
+/**
+ *
+ */
+static void
+uring_drain_dirty(asyncio_loop_t *al)
+{
+  asyncio_uring_t *au = al->al_uring;
+  asyncio_fd_t *af, *next;
+
+  af = __atomic_exchange_n(&au->au_dirty, NULL, __ATOMIC_SEQ_CST);
+  for(; af != NULL; af = next) {
+    next = af->af_uring_dirty_next;
+    __atomic_store_n(&af->af_uring_dirty, 0, __ATOMIC_SEQ_CST);
+    uring_sync(au, af);
+    asyncio_fd_release(af);
   }
-  snprintf(errbuf, errlen, "SSL: Hostname mismatch");
-  return -1;
 }
+#endif
 
 
+#ifdef __linux__
+static void et_pollout_task(void *aux);
+
+/**
+ * Edge triggered fds are registered for both directions once. The
+ * interest set lives in af_epoll_flags and readiness edges we are not
+ * interested in yet are remembered in af_et_ready.
+ */
 static int
-asyncio_ssl_verify(asyncio_fd_t *af)
+et_filter_events(asyncio_fd_t *af, int events)
 {
-  X509 *peer = SSL_get_peer_certificate(af->af_ssl);
-  if(peer == NULL) {
-    return EDOM;
-  }
+  if(events & EPOLLOUT)
+    __atomic_fetch_or(&af->af_et_ready, EPOLLOUT, __ATOMIC_SEQ_CST);
+  const int interest = __atomic_load_n(&af->af_epoll_flags, __ATOMIC_SEQ_CST);
+  return events & (interest | EPOLLHUP | EPOLLERR);
+}
 
-  const int err = SSL_get_verify_result(af->af_ssl);
-  if(err != X509_V_OK) {
-    X509_free(peer);
-    return EDOM;
-  }
 
-  if(verify_hostname(af->af_hostname, peer, NULL, 0)) {
-    X509_free(peer);
-    return EDOM;
-  }
-  X509_free(peer);
-  return 0;
+/**
+ * Must be called before each write attempt so an edge arriving after
+ * it is not lost
+ */
+static void
+et_clear_writable(asyncio_fd_t *af)
+{
+  if(af->af_flags & ASYNCIO_FLAG_EDGE_TRIGGERED)
+    __atomic_fetch_and(&af->af_et_ready, ~EPOLLOUT, __ATOMIC_SEQ_CST);
 }
 
 
 /**
  *
  */
-static int
-asyncio_ssl_handshake(asyncio_fd_t *af)
+static void
+mod_poll_flags(asyncio_fd_t *af, int set, int clr)
 {
-  int r = SSL_do_handshake(af->af_ssl);
-  int err = SSL_get_error(af->af_ssl, r);
-  switch(err) {
-  case SSL_ERROR_WANT_READ:
-    mod_poll_flags(af, EPOLLIN, EPOLLOUT);
-    return 0;
-
-  case SSL_ERROR_WANT_WRITE:
-    mod_poll_flags(af, EPOLLOUT, EPOLLIN);
-    return 0;
+  struct epoll_event e;
+  int f = (af->af_epoll_flags | set) & ~clr;
 
-  case SSL_ERROR_NONE:
-    mod_poll_flags(af, EPOLLIN, EPOLLOUT);
-    if(af->af_sendq.mq_size)
-      mod_poll_flags(af, EPOLLOUT, 0);
+  if(f == af->af_epoll_flags)
+    return;
 
-    af->af_ssl_established = 1;
+  assert(af->af_fd != -1);
 
-    if(af->af_hostname != NULL &&
-       af->af_flags & ASYNCIO_FLAG_SSL_VERIFY_CERT)
-      return asyncio_ssl_verify(af);
+  if(af->af_flags & ASYNCIO_FLAG_EDGE_TRIGGERED && f && af->af_epoll_flags) {
+    // Registered for everything already, only the interest changes
+    const int added = f & ~af->af_epoll_flags;
+    __atomic_store_n(&af->af_epoll_flags, f, __ATOMIC_SEQ_CST);
+    if(added & __atomic_load_n(&af->af_et_ready, __ATOMIC_SEQ_CST)) {
+      // The edge may have been dropped by et_filter_events()
+      asyncio_fd_retain(af);
+      asyncio_loop_run_task(af->af_loop, et_pollout_task, af, 0);
+    }
+    return;
+  }
 
-    return 0;
-
-  default:
-#if 1
-    trace(LOG_ERR, "SSL: Unable to handshake, err:%d r:%d errno:%d",
-          err, r, errno);
-    ssldump(af);
-#endif
-    return ENOLINK;
+  __atomic_fetch_add(&af->af_loop->al_stats.poll_updates, 1,
+                     __ATOMIC_RELAXED);
+
+#ifdef WITH_IO_URING
+  asyncio_loop_t *al = af->af_loop;
+  if(al->al_uring != NULL) {
+    __atomic_store_n(&af->af_epoll_flags, f, __ATOMIC_SEQ_CST);
+    if(al == asyncio_current_loop)
+      uring_sync(al->al_uring, af);
+    else
+      uring_mark_dirty(al, af);
+    return;
   }
-  return 0;
-}
-
-
+#endif
 
 
-static void
-do_ssl_update_poll_flags_ex(asyncio_fd_t *af, int line)
-{
-#if 0
-  printf("Update poll flags line %d\n", line);
-  printf("  READ: %s\n",
-         af->af_ssl_read_status == SSL_ERROR_WANT_READ  ? "READ" :
-         af->af_ssl_read_status == SSL_ERROR_WANT_WRITE ? "WRITE" : "-");
+  e.data.ptr = af;
+  e.events = f;
+  if(af->af_flags & ASYNCIO_FLAG_EDGE_TRIGGERED && f)
+    e.events = EPOLLIN | EPOLLOUT | EPOLLET;
 
-  printf(" WRITE: %s\n",
-         af->af_ssl_write_status == SSL_ERROR_WANT_READ  ? "READ" :
-         af->af_ssl_write_status == SSL_ERROR_WANT_WRITE ? "WRITE" : "-");
-#endif
-  int events = 0;
-  if(af->af_ssl_read_status == SSL_ERROR_WANT_WRITE) {
-    events |= EPOLLOUT;
+  int op;
+  if(!f) {
+    op =  EPOLL_CTL_DEL;
+  } else if(!af->af_epoll_flags) {
+    op =  EPOLL_CTL_ADD;
   } else {
-    events |= EPOLLIN;
-  }
-
-  if(af->af_ssl_write_status == SSL_ERROR_WANT_WRITE) {
-    events |= EPOLLOUT;
-  } else if(af->af_ssl_write_status == SSL_ERROR_WANT_READ) {
-    events |= EPOLLIN;
+    op =  EPOLL_CTL_MOD;
   }
-  //  printf("mod poll flags: %x\n", events);
-  mod_poll_flags(af, events, ~events & (EPOLLIN | EPOLLOUT));
-}
 
+  int r = epoll_ctl(af->af_loop->al_epfd, op, af->af_fd, &e);
 
-#define do_ssl_update_poll_flags(af) \
-  do_ssl_update_poll_flags_ex(af, __LINE__)
+  if(r) {
+    fprintf(stderr, "epoll_ctl(%d, %d, %x) -- %s\n",
+	    op, af->af_fd, e.events, strerror(errno));
+  }
 
-static int do_ssl_write_locked(asyncio_fd_t *af);
+  af->af_epoll_flags = f;
+}
 
 
 /**
  *
  */
-static int
-do_ssl_read_locked(asyncio_fd_t *af)
+static void
+et_pollout_task(void *aux)
 {
-  char buf[4096];
-  af->af_ssl_read_status = 0;
-
-  while(af->af_ssl != NULL) {
-    if(af->af_ssl_write_status == SSL_ERROR_WANT_READ) {
-      return 0;
-    }
-    af->af_ssl_read_status = 0;
-    int r = SSL_read(af->af_ssl, buf, sizeof(buf));
-    int err = SSL_get_error(af->af_ssl, r);
-    switch(err) {
-    case SSL_ERROR_NONE:
-      mbuf_append(&af->af_recvq, buf, r);
-      break;
-
-    case SSL_ERROR_ZERO_RETURN:
-      // Conection closed
-      do_ssl_update_poll_flags(af);
-      return ECONNRESET;
-
-    case SSL_ERROR_SYSCALL:
-      return errno ?: ECONNRESET;
+  asyncio_fd_t *af = aux;
+  if(af->af_fd != -1 && af->af_epoll_flags & EPOLLOUT)
+    af->af_pollout(af);
+  asyncio_fd_release(af);
+}
+#endif
 
-    default:
-      do_ssl_update_poll_flags(af);
-      return ENOLINK;
+#ifdef __APPLE__
 
-    case SSL_ERROR_WANT_READ:
-    case SSL_ERROR_WANT_WRITE:
-      af->af_ssl_read_status = err;
-      do_ssl_update_poll_flags(af);
-      return 0;
-    }
+#define EPOLLIN  0x1
+#define EPOLLOUT 0x2
+#define MSG_NOSIGNAL 0
+#define MSG_MORE 0
 
-    af_unlock(af);
-    af->af_bytes_avail(af->af_opaque, &af->af_recvq);
-    af_lock(af);
-  }
-  return 0;
-}
+#define et_clear_writable(af)
 
 /**
  *
  */
 static void
-do_ssl_read(asyncio_fd_t *af)
+mod_poll_flags(asyncio_fd_t *af, int set, int clr)
 {
-  af_lock(af);
+  set &= ~af->af_epoll_flags;
+  clr &=  af->af_epoll_flags;
 
-  if(!af->af_ssl_established) {
-    int err = asyncio_ssl_handshake(af);
-    af_unlock(af);
-    if(err)
-      do_error(af, err);
-    return;
+  assert(af->af_fd != -1);
+
+  struct kevent changes[2];
+  int num_changes = 0;
+
+  if(set & EPOLLIN) {
+    EV_SET(&changes[0], af->af_fd, EVFILT_READ, EV_ADD, 0, 0, af);
+    num_changes++;
+  } else if(clr & EPOLLIN) {
+    EV_SET(&changes[0], af->af_fd, EVFILT_READ, EV_DELETE, 0, 0, af);
+    num_changes++;
   }
 
-  if(af->af_ssl_write_status == SSL_ERROR_WANT_READ) {
-    do_ssl_write_locked(af);
-    return;
+  if(set & EPOLLOUT) {
+    EV_SET(&changes[num_changes], af->af_fd, EVFILT_WRITE, EV_ADD, 0, 0, af);
+    num_changes++;
+  } else if(clr & EPOLLOUT) {
+    EV_SET(&changes[num_changes], af->af_fd, EVFILT_WRITE, EV_DELETE, 0, 0, af);
+    num_changes++;
   }
 
-  af->af_ssl_read_status = 0;
+  __atomic_fetch_add(&af->af_loop->al_stats.poll_updates, 1,
+                     __ATOMIC_RELAXED);
 
-  int err = do_ssl_read_locked(af);
+  struct timespec instant = {};
+  int r = kevent(af->af_loop->al_epfd, changes, num_changes, NULL, 0,
+                 &instant);
+  if(r == -1)
+    perror("kevent() modify");
 
-  af_unlock(af);
-  if(err)
-    do_error(af, err);
+  af->af_epoll_flags = (af->af_epoll_flags | set) & ~clr;
 }
+#endif
 
 
-static int
-do_ssl_write_locked(asyncio_fd_t *af)
+/**
+ *
+ */
+static asyncio_fd_t *
+asyncio_fd_create(asyncio_loop_t *al, int fd, int initial_poll_flags)
 {
-  if(!af->af_ssl_established) {
-    return asyncio_ssl_handshake(af);
-  }
-  char tmp[1024];
-
-  if(af->af_ssl_read_status == SSL_ERROR_WANT_WRITE) {
-    do_ssl_read_locked(af);
-    return 0;
-  }
-
-  while(1) {
-    af->af_ssl_write_status = 0;
-    int avail = mbuf_peek(&af->af_sendq, tmp, sizeof(tmp));
-    if(avail == 0) {
-      if(af->af_pending_shutdown) {
-        SSL_shutdown(af->af_ssl);
-      }
-      do_ssl_update_poll_flags(af);
-      return 0;
-    }
+  asyncio_fd_t *af = calloc(1, sizeof(asyncio_fd_t));
+  af->af_loop = al;
+  af->af_fd = fd;
+  atomic_set(&af->af_refcount, 1);
+  mbuf_init(&af->af_sendq);
+  mbuf_init(&af->af_recvq);
+  TAILQ_INIT(&af->af_sendfiles);
+  af->af_read_size = ASYNCIO_READ_SIZE_MIN;
+  if(initial_poll_flags)
+    mod_poll_flags(af, initial_poll_flags, 0);
+  return af;
+}
 
-    int r = SSL_write(af->af_ssl, tmp, avail);
-    int err = SSL_get_error(af->af_ssl, r);
-    switch(err) {
-    case SSL_ERROR_NONE:
-      mbuf_drop(&af->af_sendq, r);
-      if(af->af_flags & ASYNCIO_FLAG_THREAD_SAFE)
-        pthread_cond_signal(&af->af_sendq_cond);
-      continue;
 
-    case SSL_ERROR_WANT_READ:
-    case SSL_ERROR_WANT_WRITE:
-      af->af_ssl_write_status = err;
-      // FALLTHRU
-    default:
-      do_ssl_update_poll_flags(af);
-      return 0;
-    }
-  }
+/**
+ *
+ */
+void
+asyncio_fd_retain(asyncio_fd_t *af)
+{
+  atomic_inc(&af->af_refcount);
 }
-#endif
 
 
 /**
  *
  */
 static void
-do_accept(asyncio_fd_t *af)
+asyncio_dial_free(asyncio_dial_t *ad)
 {
-  struct sockaddr_storage remote, local;
-  socklen_t slen;
+  if(ad->ad_res != NULL)
+    freeaddrinfo(ad->ad_res);
+  free(ad);
+}
 
-  slen = sizeof(struct sockaddr_storage);
 
-  int fd = libsvc_accept(af->af_fd, (struct sockaddr *)&remote, &slen);
-  if(fd == -1) {
-    perror("accept");
+/**
+ *
+ */
+void
+asyncio_fd_release(asyncio_fd_t *af)
+{
+  if(atomic_dec(&af->af_refcount))
     return;
-  }
 
-  setup_tcp_socket(fd);
+  assert(af->af_fd == -1);
 
-  slen = sizeof(struct sockaddr_storage);
-  if(getsockname(fd, (struct sockaddr *)&local, &slen)) {
-    close(fd);
-    return;
+  if(af->af_flags & ASYNCIO_FLAG_THREAD_SAFE) {
+    pthread_mutex_destroy(&af->af_sendq_mutex);
+    pthread_cond_destroy(&af->af_sendq_cond);
   }
 
-  if(af->af_accept(af->af_opaque, fd,
-                   (struct sockaddr *)&remote,
-                   (struct sockaddr *)&local)) {
-    close(fd);
+  asyncio_sendfile_t *asf;
+  while((asf = TAILQ_FIRST(&af->af_sendfiles)) != NULL) {
+    TAILQ_REMOVE(&af->af_sendfiles, asf, asf_link);
+    close(asf->asf_fd);
+    free(asf);
   }
+
+  mbuf_clear(&af->af_sendq);
+  mbuf_clear(&af->af_recvq);
+  free(af->af_read_spare);
+  free(af->af_hostname);
+  free(af->af_listener);
+  if(af->af_dial != NULL)
+    asyncio_dial_free(af->af_dial);
+#if defined(WITH_OPENSSL)
+  free(af->af_ssl_session_key);
+#endif
+  free(af);
 }
 
 
+
 /**
  *
  */
 static int
-tw_step(void)
+af_sendq_empty(const asyncio_fd_t *af)
 {
-  asyncio_timer_t *at, *next;
-  int64_t now = asyncio_get_monotime();
-  int target_slot = (now >> TW_TIME_SHIFT) & TW_SLOT_MASK;
-  int cbs = 0;
-  struct asyncio_timer_list tmplist;
-  LIST_INIT(&tmplist);
+  return af->af_sendq.mq_size == 0 && TAILQ_FIRST(&af->af_sendfiles) == NULL;
+}
 
-  while(timerwheel_read_pos != target_slot) {
-    timerwheel_read_pos = (timerwheel_read_pos + 1) & TW_SLOT_MASK;
 
-    for(at = LIST_FIRST(&timerwheel[timerwheel_read_pos]);
-        at != NULL; at = next) {
-      next = LIST_NEXT(at, at_link);
-      if(at->at_expire <= now) {
-        LIST_REMOVE(at, at_link);
-        LIST_INSERT_HEAD(&tmplist, at, at_link);
-      }
-    }
+/**
+ * Max number of bytes from af_sendq that may be sent before the
+ * next file segment
+ */
+static size_t
+af_sendq_sendable(const asyncio_fd_t *af)
+{
+  const asyncio_sendfile_t *asf = TAILQ_FIRST(&af->af_sendfiles);
+  return asf != NULL ? asf->asf_mbuf_bytes : af->af_sendq.mq_size;
+}
 
-    while((at = LIST_FIRST(&tmplist)) != NULL) {
-      LIST_REMOVE(at, at_link);
-      at->at_expire = 0;
-      at->at_fn(at->at_opaque);
-      cbs++;
-    }
-  }
 
-  const int slottime = 1 << TW_TIME_SHIFT;
-  int spill = now & (slottime - 1);
-  return (slottime - spill) / 1000 + 1;
+/**
+ * Next file segment if it is its turn to be sent
+ */
+static asyncio_sendfile_t *
+af_sendfile_current(const asyncio_fd_t *af)
+{
+  asyncio_sendfile_t *asf = TAILQ_FIRST(&af->af_sendfiles);
+  return asf != NULL && asf->asf_mbuf_bytes == 0 ? asf : NULL;
 }
 
 
 /**
- *
+ * Bytes queued for sending, including file segments
  */
-static void *
-asyncio_loop(void *aux)
+static size_t
+af_sendq_size(const asyncio_fd_t *af)
 {
-  int r, i;
-
-  while(1) {
-    talloc_cleanup();
+  return af->af_sendq.mq_size + af->af_sendfile_bytes;
+}
 
-    int timeout = tw_step();
 
-#ifdef __linux__
+/**
+ *
+ */
+static void
+asyncio_writable_task(void *aux)
+{
+  asyncio_fd_t *af = aux;
+  if(af->af_fd != -1 && af->af_writable != NULL)
+    af->af_writable(af->af_writable_opaque);
+  asyncio_fd_release(af);
+}
 
-    struct epoll_event ev[256];
 
-    r = epoll_wait(epfd, ev, sizeof(ev) / sizeof(ev[0]), timeout);
-    if(r == -1) {
-      if(errno == EINTR)
+/**
+ * Tell the producer it may resume once we've drained below the low
+ * watermark. Called with the send lock held so the callback is
+ * deferred to a task on the loop.
+ */
+static void
+af_check_low_watermark(asyncio_fd_t *af)
+{
+  if(!af->af_writable_armed || af_sendq_size(af) > af->af_sendq_low)
+    return;
+
+  af->af_writable_armed = 0;
+  asyncio_fd_retain(af);
+  asyncio_loop_run_task(af->af_loop, asyncio_writable_task, af, 0);
+}
+
+
+/**
+ *
+ */
+static int
+af_check_high_watermark(asyncio_fd_t *af)
+{
+  const size_t size = af_sendq_size(af);
+  af->af_sendq_peak = MAX(af->af_sendq_peak, size);
+
+  if(!af->af_sendq_high || size <= af->af_sendq_high)
+    return 0;
+
+  af->af_writable_armed = 1;
+  return ASYNCIO_SEND_BACKPRESSURE;
+}
+
+
+/**
+ *
+ */
+static void
+af_sendq_drop(asyncio_fd_t *af, size_t len)
+{
+  mbuf_drop(&af->af_sendq, len);
+  af->af_bytes_out += len;
+
+  asyncio_sendfile_t *asf = TAILQ_FIRST(&af->af_sendfiles);
+  if(asf != NULL) {
+    asf->asf_mbuf_bytes -= len;
+    af->af_sendfile_marked -= len;
+  }
+  af_check_low_watermark(af);
+}
+
+
+/**
+ *
+ */
+static void
+af_sendfile_advance(asyncio_fd_t *af, asyncio_sendfile_t *asf, size_t len)
+{
+  asf->asf_offset += len;
+  asf->asf_len -= len;
+  af->af_sendfile_bytes -= len;
+  af->af_bytes_out += len;
+  if(asf->asf_len == 0) {
+    TAILQ_REMOVE(&af->af_sendfiles, asf, asf_link);
+    close(asf->asf_fd);
+    free(asf);
+  }
+  af_check_low_watermark(af);
+}
+
+
+/**
+ * Returns bytes sent or -1 with errno set
+ */
+static int64_t
+do_sendfile(asyncio_fd_t *af, asyncio_sendfile_t *asf)
+{
+  const size_t len = MIN(asf->asf_len, ASYNCIO_SENDFILE_CHUNK);
+#if defined(__APPLE__)
+  off_t sent = len;
+  if(sendfile(asf->asf_fd, af->af_fd, asf->asf_offset, &sent, NULL, 0) &&
+     sent == 0)
+    return -1;
+  return sent;
+#else
+  off_t offset = asf->asf_offset;
+  return sendfile(af->af_fd, asf->asf_fd, &offset, len);
+#endif
+}
+
+
+/**
+ *
+ */
+static size_t
+iovec_trim(struct iovec *iov, int *iovcnt, size_t avail, size_t max)
+{
+  if(avail <= max)
+    return avail;
+
+  size_t total = 0;
+  for(int i = 0; i < *iovcnt; i++) {
+    if(total + iov[i].iov_len >= max) {
+      iov[i].iov_len = max - total;
+      *iovcnt = i + 1;
+      return max;
+    }
+    total += iov[i].iov_len;
+  }
+  return total;
+}
+
+
+/**
+ *
+ */
+static int
+do_write_locked(asyncio_fd_t *af)
+{
+  struct iovec iov[ASYNCIO_IOV_MAX];
+
+  while(1) {
+    et_clear_writable(af);
+
+    asyncio_sendfile_t *asf = af_sendfile_current(af);
+    if(asf != NULL) {
+      const int64_t len = asf->asf_len;
+      const int64_t r = do_sendfile(af, asf);
+
+      if(r == -1 && (errno == EAGAIN || errno == EINTR))
+        break;
+
+      if(r == -1) {
+        mod_poll_flags(af, 0, EPOLLOUT);
+        return errno;
+      }
+
+      if(r == 0) {
+        // File is shorter than what we were asked to send
+        mod_poll_flags(af, 0, EPOLLOUT);
+        return EIO;
+      }
+
+      af_sendfile_advance(af, asf, r);
+
+      if(af->af_flags & ASYNCIO_FLAG_THREAD_SAFE)
+        pthread_cond_signal(&af->af_sendq_cond);
+
+      if(r != MIN(len, ASYNCIO_SENDFILE_CHUNK))
+        break;
+      continue;
+    }
+
+    size_t avail;
+    int iovcnt = mbuf_peek_iovec(&af->af_sendq, iov, ASYNCIO_IOV_MAX,
+                                 &avail);
+    avail = iovec_trim(iov, &iovcnt, avail, af_sendq_sendable(af));
+    if(iovcnt == 0) {
+      if(af->af_pending_shutdown) {
+#if defined(WITH_OPENSSL)
+        if(af->af_ssl != NULL)
+          SSL_shutdown(af->af_ssl);
+        else
+#endif
+          shutdown(af->af_fd, 2);
+      }
+      // Nothing more to send
+      mod_poll_flags(af, 0, EPOLLOUT);
+      return 0;
+    }
+
+    const struct msghdr msg = {
+      .msg_iov = iov,
+      .msg_iovlen = iovcnt
+    };
+
+    ssize_t r = sendmsg(af->af_fd, &msg, MSG_NOSIGNAL);
+    if(r == 0)
+      break;
+
+    if(r == -1 && (errno == EAGAIN || errno == EINTR))
+      break;
+
+    if(r == -1) {
+      mod_poll_flags(af, 0, EPOLLOUT);
+      return errno;
+    }
+
+    af_sendq_drop(af, r);
+
+    if(af->af_flags & ASYNCIO_FLAG_THREAD_SAFE)
+      pthread_cond_signal(&af->af_sendq_cond);
+
+    if(r != avail)
+      break;
+  }
+
+  mod_poll_flags(af, EPOLLOUT, 0);
+  return 0;
+}
+
+
+
+/**
+ *
+ */
+int
+asyncio_wait_send_buffer(asyncio_fd_t *af, int size)
+{
+  int r = 0;
+  pthread_mutex_lock(&af->af_sendq_mutex);
+
+  while(1) {
+    if(af->af_pending_error) {
+      r = af->af_pending_error;
+      break;
+    }
+
+    if(size > af_sendq_size(af))
+      break;
+
+    pthread_cond_wait(&af->af_sendq_cond, &af->af_sendq_mutex);
+  }
+  pthread_mutex_unlock(&af->af_sendq_mutex);
+  return r;
+}
+
+
+/**
+ *
+ */
+static void
+do_error(asyncio_fd_t *af, int error)
+{
+  if(af->af_flags & ASYNCIO_FLAG_THREAD_SAFE) {
+    pthread_mutex_lock(&af->af_sendq_mutex);
+    af->af_pending_error = error;
+    pthread_cond_signal(&af->af_sendq_cond);
+    pthread_mutex_unlock(&af->af_sendq_mutex);
+  }
+  if(af->af_error != NULL)
+    af->af_error(af->af_opaque, error);
+  af->af_error = NULL;
+}
+
+
+/**
+ *
+ */
+static void
+do_write_unlocked(asyncio_fd_t *af)
+{
+  af_lock(af);
+  int err = af->af_locked_write(af);
+  af_unlock(af);
+  if(err)
+    do_error(af, err);
+}
+
+
+/**
+ *
+ */
+static void *
+af_read_spare(asyncio_fd_t *af, size_t min_size)
+{
+  const size_t size = MAX(af->af_read_size, min_size);
+  if(af->af_read_spare != NULL && af->af_read_spare_size != size) {
+    free(af->af_read_spare);
+    af->af_read_spare = NULL;
+  }
+  if(af->af_read_spare == NULL) {
+    af->af_read_spare = malloc(size);
+    af->af_read_spare_size = size;
+  }
+  return af->af_read_spare;
+}
+
+
+/**
+ * Account 'len' bytes read into tail space followed by the spare chunk
+ */
+static void
+af_read_commit(asyncio_fd_t *af, size_t tail, size_t len)
+{
+  af->af_bytes_in += len;
+  if(len <= tail) {
+    mbuf_commit_tail(&af->af_recvq, len);
+    return;
+  }
+  mbuf_commit_tail(&af->af_recvq, tail);
+  mbuf_append_chunk(&af->af_recvq, af->af_read_spare,
+                    af->af_read_spare_size, len - tail);
+  af->af_read_spare = NULL;
+}
+
+
+/**
+ * Grow read chunks for fds that keep filling them, shrink them for fds
+ * that only see small reads
+ */
+static void
+af_read_adapt(asyncio_fd_t *af, size_t len, size_t space)
+{
+  if(len == space)
+    af->af_read_size = MIN(af->af_read_size * 2, ASYNCIO_READ_SIZE_MAX);
+  else if(len < af->af_read_size / 8)
+    af->af_read_size = MAX(af->af_read_size / 2, ASYNCIO_READ_SIZE_MIN);
+}
+
+
+/**
+ *
+ */
+static void
+do_read(asyncio_fd_t *af)
+{
+  while(1) {
+    struct iovec iov[2];
+    int iovcnt = 0;
+    size_t tail;
+    void *t = mbuf_tail_space(&af->af_recvq, &tail);
+
+    if(tail > 0) {
+      iov[iovcnt].iov_base = t;
+      iov[iovcnt].iov_len = tail;
+      iovcnt++;
+    }
+
+    size_t space = tail;
+    if(tail < af->af_read_size) {
+      iov[iovcnt].iov_base = af_read_spare(af, 0);
+      iov[iovcnt].iov_len = af->af_read_spare_size;
+      space += af->af_read_spare_size;
+      iovcnt++;
+    }
+
+    ssize_t r = readv(af->af_fd, iov, iovcnt);
+    if(r == 0) {
+      if(af->af_recvq.mq_size)
+        af->af_bytes_avail(af->af_opaque, &af->af_recvq);
+      do_error(af, ECONNRESET);
+      return;
+    }
+
+    if(r == -1 && (errno == EAGAIN || errno == EINTR))
+      break;
+
+    if(r == -1) {
+      do_error(af, errno);
+      return;
+    }
+
+    af_read_commit(af, tail, r);
+    af_read_adapt(af, r, space);
+
+    // Short read, socket is drained
+    if(r < space)
+      break;
+  }
+
+  af->af_bytes_avail(af->af_opaque, &af->af_recvq);
+}
+
+
+
+#if defined(WITH_OPENSSL)
+static void __attribute__((unused))
+ssldump(asyncio_fd_t *af)
+{
+  unsigned long e;
+  char errbuf[512];
+  while((e = ERR_get_error()) != 0) {
+    ERR_error_string_n(e, errbuf, sizeof(errbuf));
+      trace(LOG_ERR, "SSL: %s", errbuf);
+  }
+}
+
+
+
+/**
+ *
+ */
+static int
+verify_hostname(const char *hostname, X509 *cert, char *errbuf, size_t errlen)
+{
+  int i;
+  /* domainname is the "domain" we wan't to access (actually hostname
+   * with first part of the DNS name removed) */
+  const char *domainname = strchr(hostname, '.');
+  if(domainname != NULL) {
+      domainname++;
+      if(strlen(domainname) == 0)
+        domainname = NULL;
+  }
+
+
+  // First check commonName
+
+  X509_NAME *subjectName;
+  char commonName[256];
+
+  subjectName = X509_get_subject_name(cert);
+  if(X509_NAME_get_text_by_NID(subjectName, NID_commonName,
+                               commonName, sizeof(commonName)) != -1) {
+    if(!strcmp(commonName, hostname))
+      return 0;
+  }
+
+  // Then check altNames
+
+  GENERAL_NAMES *names = X509_get_ext_d2i( cert, NID_subject_alt_name, 0, 0);
+  if(names == NULL) {
+    snprintf(errbuf, errlen, "SSL: No subjectAltName extension");
+    return -1;
+  }
+
+  const int num_names = sk_GENERAL_NAME_num(names);
+
+  for(i = 0; i < num_names; ++i ) {
+    GENERAL_NAME *name = sk_GENERAL_NAME_value(names, i);
+    unsigned char *dns;
+    int match;
+
+    if(name->type != GEN_DNS)
+      continue;
+
+    ASN1_STRING_to_UTF8(&dns, name->d.dNSName);
+    if(dns[0] == '*' && dns[1] == '.') {
+      match = domainname != NULL && !strcasecmp((char *)dns+2, domainname);
+    } else {
+      match = !strcasecmp((char *)dns, hostname);
+    }
+
+    OPENSSL_free(dns);
+    if(match)
+      return 0;
+  }
+  snprintf(errbuf, errlen, "SSL: Hostname mismatch");
+  return -1;
+}
+
+
+static int
+asyncio_ssl_verify(asyncio_fd_t *af)
+{
+  X509 *peer = SSL_get_peer_certificate(af->af_ssl);
+  if(peer == NULL) {
+    return EDOM;
+  }
+
+  const int err = SSL_get_verify_result(af->af_ssl);
+  if(err != X509_V_OK) {
+    X509_free(peer);
+    return EDOM;
+  }
+
+  if(verify_hostname(af->af_hostname, peer, NULL, 0)) {
+    X509_free(peer);
+    return EDOM;
+  }
+  X509_free(peer);
+  return 0;
+}
+
+
+/**
+ *
+ */
+static int
+asyncio_ssl_handshake(asyncio_fd_t *af)
+{
+  const int64_t cpu = thread_cpu_time();
+  int r = SSL_do_handshake(af->af_ssl);
+  int err = SSL_get_error(af->af_ssl, r);
+  af->af_ssl_handshake_cpu += thread_cpu_time() - cpu;
+
+  switch(err) {
+  case SSL_ERROR_WANT_READ:
+    mod_poll_flags(af, EPOLLIN, EPOLLOUT);
+    return 0;
+
+  case SSL_ERROR_WANT_WRITE:
+    mod_poll_flags(af, EPOLLOUT, EPOLLIN);
+    return 0;
+
+  case SSL_ERROR_NONE:
+    mod_poll_flags(af, EPOLLIN, EPOLLOUT);
+    if(!af_sendq_empty(af))
+      mod_poll_flags(af, EPOLLOUT, 0);
+
+    af->af_ssl_established = 1;
+
+    __atomic_add_fetch(&asyncio_tls_stats.handshakes, 1, __ATOMIC_RELAXED);
+    if(SSL_session_reused(af->af_ssl))
+      __atomic_add_fetch(&asyncio_tls_stats.resumed, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&asyncio_tls_stats.handshake_cpu_us,
+                       af->af_ssl_handshake_cpu, __ATOMIC_RELAXED);
+
+#ifdef ASYNCIO_KTLS
+    // Record encryption has been handed to the kernel
+    if(BIO_get_ktls_send(SSL_get_wbio(af->af_ssl)))
+      af->af_ktls_send = 1;
+#endif
+
+    if(af->af_hostname != NULL &&
+       af->af_flags & ASYNCIO_FLAG_SSL_VERIFY_CERT)
+      return asyncio_ssl_verify(af);
+
+    return 0;
+
+  default:
+    __atomic_add_fetch(&asyncio_tls_stats.failed, 1, __ATOMIC_RELAXED);
+#if 1
+    trace(LOG_ERR, "SSL: Unable to handshake, err:%d r:%d errno:%d",
+          err, r, errno);
+    ssldump(af);
+#endif
+    return ENOLINK;
+  }
+  return 0;
+}
+
+
+
+
+static void
+do_ssl_update_poll_flags_ex(asyncio_fd_t *af, int line)
+{
+#if 0
+  printf("Update poll flags line %d\n", line);
+  printf("  READ: %s\n",
+         af->af_ssl_read_status == SSL_ERROR_WANT_READ  ? "READ" :
+         af->af_ssl_read_status == SSL_ERROR_WANT_WRITE ? "WRITE" : "-");
+
+  printf(" WRITE: %s\n",
+         af->af_ssl_write_status == SSL_ERROR_WANT_READ  ? "READ" :
+         af->af_ssl_write_status == SSL_ERROR_WANT_WRITE ? "WRITE" : "-");
+#endif
+  int events = 0;
+  if(af->af_ssl_read_status == SSL_ERROR_WANT_WRITE) {
+    events |= EPOLLOUT;
+  } else {
+    events |= EPOLLIN;
+  }
+
+  if(af->af_ssl_write_status == SSL_ERROR_WANT_WRITE) {
+    events |= EPOLLOUT;
+  } else if(af->af_ssl_write_status == SSL_ERROR_WANT_READ) {
+    events |= EPOLLIN;
+  }
+
+  if(af->af_ktls_send && !af_sendq_empty(af))
+    events |= EPOLLOUT;
+  //  printf("mod poll flags: %x\n", events);
+  mod_poll_flags(af, events, ~events & (EPOLLIN | EPOLLOUT));
+}
+
+
+#define do_ssl_update_poll_flags(af) \
+  do_ssl_update_poll_flags_ex(af, __LINE__)
+
+static int do_ssl_write_locked(asyncio_fd_t *af);
+
+
+/**
+ *
+ */
+static int
+do_ssl_read_locked(asyncio_fd_t *af)
+{
+  af->af_ssl_read_status = 0;
+
+  while(af->af_ssl != NULL) {
+    if(af->af_ssl_write_status == SSL_ERROR_WANT_READ) {
+      return 0;
+    }
+    af->af_ssl_read_status = 0;
+
+    // Decrypt straight into the receive queue, use a fresh chunk
+    // if there is not room for a reasonable part of a record
+    size_t tail;
+    void *buf = mbuf_tail_space(&af->af_recvq, &tail);
+    size_t space = tail;
+    if(tail < ASYNCIO_SSL_RECORD_SIZE / 4) {
+      buf = af_read_spare(af, ASYNCIO_SSL_RECORD_SIZE);
+      space = af->af_read_spare_size;
+      tail = 0;
+    }
+
+    int r = SSL_read(af->af_ssl, buf, MIN(space, INT32_MAX));
+    int err = SSL_get_error(af->af_ssl, r);
+    switch(err) {
+    case SSL_ERROR_NONE:
+      af_read_commit(af, tail, r);
+      af_read_adapt(af, r, space);
+      break;
+
+    case SSL_ERROR_ZERO_RETURN:
+      // Conection closed
+      do_ssl_update_poll_flags(af);
+      return ECONNRESET;
+
+    case SSL_ERROR_SYSCALL:
+      return errno ?: ECONNRESET;
+
+    default:
+      do_ssl_update_poll_flags(af);
+      return ENOLINK;
+
+    case SSL_ERROR_WANT_READ:
+    case SSL_ERROR_WANT_WRITE:
+      af->af_ssl_read_status = err;
+      do_ssl_update_poll_flags(af);
+      return 0;
+    }
+
+    af_unlock(af);
+    af->af_bytes_avail(af->af_opaque, &af->af_recvq);
+    af_lock(af);
+  }
+  return 0;
+}
+
+/**
+ *
+ */
+static void
+do_ssl_read(asyncio_fd_t *af)
+{
+  af_lock(af);
+
+  if(!af->af_ssl_established) {
+    int err = asyncio_ssl_handshake(af);
+    af_unlock(af);
+    if(err)
+      do_error(af, err);
+    return;
+  }
+
+  if(af->af_ssl_write_status == SSL_ERROR_WANT_READ) {
+    do_ssl_write_locked(af);
+    return;
+  }
+
+  af->af_ssl_read_status = 0;
+
+  int err = do_ssl_read_locked(af);
+
+  af_unlock(af);
+  if(err)
+    do_error(af, err);
+}
+
+
+static int
+do_ssl_write_locked(asyncio_fd_t *af)
+{
+  if(!af->af_ssl_established) {
+    return asyncio_ssl_handshake(af);
+  }
+  char tmp[ASYNCIO_SSL_RECORD_SIZE];
+
+  if(af->af_ssl_read_status == SSL_ERROR_WANT_WRITE) {
+    do_ssl_read_locked(af);
+    return 0;
+  }
+
+  if(af->af_ktls_send)
+    return do_write_locked(af);
+
+  while(1) {
+    af->af_ssl_write_status = 0;
+    const void *buf;
+    int avail;
+    asyncio_sendfile_t *asf = af_sendfile_current(af);
+
+    if(asf != NULL) {
+      // No zero-copy path through TLS, read and encrypt a record at a time
+      ssize_t n = pread(asf->asf_fd, tmp, MIN(sizeof(tmp), asf->asf_len),
+                        asf->asf_offset);
+      if(n == -1 && errno == EINTR)
+        continue;
+      if(n <= 0) {
+        do_ssl_update_poll_flags(af);
+        return n == 0 ? EIO : errno;
+      }
+      avail = n;
+      buf = tmp;
+    } else {
+      const size_t sendable = af_sendq_sendable(af);
+      avail = MIN(mbuf_peek_no_copy(&af->af_sendq, &buf), sendable);
+      if(avail < sizeof(tmp) && sendable > avail) {
+        // Coalesce small buffers so we emit full sized records
+        avail = mbuf_peek(&af->af_sendq, tmp, MIN(sizeof(tmp), sendable));
+        buf = tmp;
+      }
+    }
+    if(avail == 0) {
+      if(af->af_pending_shutdown) {
+        SSL_shutdown(af->af_ssl);
+      }
+      do_ssl_update_poll_flags(af);
+      return 0;
+    }
+
+    int r = SSL_write(af->af_ssl, buf, avail);
+    int err = SSL_get_error(af->af_ssl, r);
+    switch(err) {
+    case SSL_ERROR_NONE:
+      if(asf != NULL)
+        af_sendfile_advance(af, asf, r);
+      else
+        af_sendq_drop(af, r);
+      if(af->af_flags & ASYNCIO_FLAG_THREAD_SAFE)
+        pthread_cond_signal(&af->af_sendq_cond);
+      continue;
+
+    case SSL_ERROR_WANT_READ:
+    case SSL_ERROR_WANT_WRITE:
+      af->af_ssl_write_status = err;
+      // FALLTHRU
+    default:
+      do_ssl_update_poll_flags(af);
+      return 0;
+    }
+  }
+}
+#endif
+
+
+/**
+ *
+ */
+static void
+accept_fd(asyncio_fd_t *af, int fd, const struct sockaddr_storage *remote)
+{
+  struct sockaddr_storage local;
+  struct sockaddr *self = NULL;
+
+#ifdef __linux__
+  asyncio_accepted_fd = fd;
+#else
+  setup_tcp_socket(fd);
+#endif
+
+  if(af->af_listener->asl_flags & ASYNCIO_BIND_F_LOCAL_ADDR) {
+    socklen_t slen = sizeof(struct sockaddr_storage);
+    if(getsockname(fd, (struct sockaddr *)&local, &slen)) {
+      close(fd);
+      asyncio_accepted_fd = -1;
+      return;
+    }
+    self = (struct sockaddr *)&local;
+  }
+
+  if(af->af_accept(af->af_opaque, fd, (struct sockaddr *)remote, self)) {
+    close(fd);
+  }
+  asyncio_accepted_fd = -1;
+}
+
+
+/**
+ *
+ */
+static void
+listener_resume(void *opaque)
+{
+  asyncio_fd_t *af = opaque;
+  if(af->af_fd != -1)
+    mod_poll_flags(af, EPOLLIN, 0);
+}
+
+
+/**
+ * Stop accepting for a while
+ */
+static void
+listener_pause(asyncio_fd_t *af, int64_t delay)
+{
+  mod_poll_flags(af, 0, EPOLLIN);
+  asyncio_timer_arm_delta(&af->af_listener->asl_timer, MAX(delay, 1));
+}
+
+
+/**
+ * Returns 0 if the accept rate limit has been reached, in which case
+ * accepting has been paused until a token is available
+ */
+static int
+listener_take_token(asyncio_fd_t *af)
+{
+  asyncio_listener_t *asl = af->af_listener;
+  if(asl->asl_rate == 0)
+    return 1;
+
+  const int64_t now = asyncio_get_monotime();
+  asl->asl_tokens = MIN(asl->asl_rate,
+                        asl->asl_tokens +
+                        (now - asl->asl_refill) * asl->asl_rate / 1e6);
+  asl->asl_refill = now;
+
+  if(asl->asl_tokens >= 1) {
+    asl->asl_tokens -= 1;
+    return 1;
+  }
+  listener_pause(af, (1 - asl->asl_tokens) * 1e6 / asl->asl_rate);
+  return 0;
+}
+
+
+/**
+ *
+ */
+static void
+accept_error(asyncio_fd_t *af, int err)
+{
+  switch(err) {
+  case EAGAIN:
+  case EINTR:
+  case ECONNABORTED:
+    return;
+
+  case EMFILE:
+  case ENFILE:
+  case ENOBUFS:
+  case ENOMEM:
+    // Out of resources, the listener would just keep firing
+    trace(LOG_ERR, "accept: %s, pausing", strerror(err));
+    listener_pause(af, ASYNCIO_ACCEPT_BACKOFF);
+    return;
+
+  default:
+    trace(LOG_ERR, "accept: %s", strerror(err));
+    return;
+  }
+}
+
+
+/**
+ *
+ */
+static void
+do_accept(asyncio_fd_t *af)
+{
+  for(int i = 0; i < ASYNCIO_ACCEPT_BUDGET && af->af_fd != -1; i++) {
+    if(!listener_take_token(af))
+      return;
+
+    struct sockaddr_storage remote;
+    socklen_t slen = sizeof(struct sockaddr_storage);
+    int fd = libsvc_accept_nonblock(af->af_fd, (struct sockaddr *)&remote,
+                                    &slen);
+    if(fd == -1) {
+      if(af->af_listener->asl_rate)
+        af->af_listener->asl_tokens += 1; // Give back the unused token
+      accept_error(af, errno);
+      return;
+    }
+    accept_fd(af, fd, &remote);
+  }
+}
+
+
+#ifdef __linux__
+/**
+ * Deliver epoll style events to an fd
+ */
+static void
+asyncio_dispatch(asyncio_fd_t *af, int events)
+{
+  if(events & EPOLLIN) {
+    af->af_pollin(af);
+  }
+
+  if(events & (EPOLLHUP | EPOLLERR) && af->af_pollerr != NULL) {
+    af->af_pollerr(af);
+    return;
+  }
+
+  if(events & EPOLLHUP) {
+    do_error(af, ECONNRESET);
+    return;
+  }
+
+  if(events & EPOLLERR) {
+    do_error(af, ENOTCONN);
+    return;
+  }
+
+  if(events & EPOLLOUT) {
+    af->af_pollout(af);
+  }
+}
+#endif
+
+
+#ifdef WITH_IO_URING
+/**
+ *
+ */
+static void
+uring_recv_complete(asyncio_uring_t *au, asyncio_fd_t *af,
+                    const struct io_uring_cqe *cqe)
+{
+  if(cqe->flags & IORING_CQE_F_BUFFER) {
+    const int bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+    void *buf = au->au_bufs[bid];
+
+    if(cqe->res > 0 && af->af_fd != -1) {
+      // The buffer becomes part of af_recvq, give the kernel a new one
+      uring_buf_provide(au, bid, NULL);
+      mbuf_append_chunk(&af->af_recvq, buf, URING_BUF_SIZE, cqe->res);
+      af->af_bytes_in += cqe->res;
+      af->af_bytes_avail(af->af_opaque, &af->af_recvq);
+    } else {
+      uring_buf_provide(au, bid, buf);
+    }
+    return;
+  }
+
+  if(af->af_fd == -1)
+    return;
+
+  switch(cqe->res) {
+  case -ENOBUFS:
+  case -ECANCELED:
+    // Rearmed (or not) by uring_sync()
+    return;
+
+  case 0:
+    af->af_uring_eof = 1;
+    if(af->af_recvq.mq_size)
+      af->af_bytes_avail(af->af_opaque, &af->af_recvq);
+    do_error(af, ECONNRESET);
+    return;
+
+  default:
+    if(cqe->res < 0) {
+      af->af_uring_eof = 1;
+      do_error(af, -cqe->res);
+    }
+    return;
+  }
+}
+
+
+/**
+ *
+ */
+static void
+uring_accept_complete(asyncio_fd_t *af, int fd)
+{
+  struct sockaddr_storage remote;
+  socklen_t slen = sizeof(struct sockaddr_storage);
+
+  if(af->af_fd == -1 ||
+     getpeername(fd, (struct sockaddr *)&remote, &slen)) {
+    close(fd);
+    return;
+  }
+  accept_fd(af, fd, &remote);
+}
+
+
+/**
+ *
+ */
+static void
+uring_complete(asyncio_loop_t *al, const struct io_uring_cqe *cqe)
+{
+  const int kind = cqe->user_data & URING_OP_MASK;
+  if(kind == URING_OP_IGNORE)
+    return;
+
+  asyncio_fd_t *af =
+    (asyncio_fd_t *)(uintptr_t)(cqe->user_data & ~(uint64_t)URING_OP_MASK);
+
+  void *fn = af_stats_fn(af);
+  const int64_t t0 = asyncio_get_monotime();
+
+  switch(kind) {
+  case URING_OP_POLL:
+    if(cqe->res > 0 && af->af_fd != -1)
+      asyncio_dispatch(af, cqe->res &
+                       (af->af_epoll_flags | EPOLLHUP | EPOLLERR));
+    break;
+
+  case URING_OP_RECV:
+    uring_recv_complete(al->al_uring, af, cqe);
+    break;
+
+  case URING_OP_ACCEPT:
+    if(cqe->res >= 0)
+      uring_accept_complete(af, cqe->res);
+    else if(cqe->res != -ECANCELED && af->af_fd != -1)
+      accept_error(af, -cqe->res);
+    break;
+  }
+
+  loop_stats_callback(al, fn, asyncio_get_monotime() - t0);
+
+  if(!(cqe->flags & IORING_CQE_F_MORE)) {
+    // Request is gone, rearm if still wanted
+    af->af_uring_live &= ~(1 << kind);
+    af->af_uring_cancel &= ~(1 << kind);
+    uring_sync(al->al_uring, af);
+    asyncio_fd_release(af);
+  }
+}
+
+
+/**
+ * Submit everything queued and wait for completions or timeout (in us)
+ */
+static void
+uring_wait(asyncio_loop_t *al, int64_t timeout)
+{
+  asyncio_uring_t *au = al->al_uring;
+  struct __kernel_timespec ts;
+  struct io_uring_getevents_arg arg = {};
+
+  if(timeout != -1) {
+    ts.tv_sec = timeout / 1000000;
+    ts.tv_nsec = (timeout % 1000000) * 1000;
+    arg.ts = (uintptr_t)&ts;
+  }
+
+  uring_drain_dirty(al);
+
+  loop_stats_wait_begin(al);
+  if(uring_enter(au, 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG,
+                 &arg, sizeof(arg)) == -1) {
+    if(errno != EINTR && errno != ETIME && errno != EBUSY) {
+      loop_stats_wait_end(al, 0);
+      perror("io_uring_enter");
+      usleep(100000);
+      return;
+    }
+  }
+
+  unsigned head = *au->au_cq_head;
+  const unsigned tail = __atomic_load_n(au->au_cq_tail, __ATOMIC_ACQUIRE);
+  loop_stats_wait_end(al, tail - head);
+
+  while(head != tail) {
+    const struct io_uring_cqe cqe = au->au_cqes[head & au->au_cq_mask];
+    head++;
+    __atomic_store_n(au->au_cq_head, head, __ATOMIC_RELEASE);
+    uring_complete(al, &cqe);
+  }
+}
+#endif
+
+
+/**
+ * Offset (circular, starting at 'start') of the first bit set in a
+ * level bitmap, or -1 if none
+ */
+static int
+tw_bitmap_find(const uint64_t *bm, int start)
+{
+  int w = start >> 6;
+  uint64_t m = bm[w] & (~0ULL << (start & 63));
+
+  for(int i = 0; i <= TW_LEVEL_SLOTS / 64; i++) {
+    if(m) {
+      const int slot = (w << 6) + __builtin_ctzll(m);
+      return (slot - start) & TW_LEVEL_MASK;
+    }
+    w = (w + 1) & (TW_LEVEL_SLOTS / 64 - 1);
+    m = bm[w];
+  }
+  return -1;
+}
+
+
+/**
+ * Earliest tick that needs processing, either to fire level 0 timers
+ * or to cascade a higher level slot. Empty slots are lazily cleared
+ * from the bitmaps here
+ */
+static uint64_t
+tw_next_tick(asyncio_loop_t *al)
+{
+  uint64_t best = TW_NEVER;
+
+  for(int level = 0; level < TW_LEVELS; level++) {
+    const int shift = level * TW_LEVEL_BITS;
+    const uint64_t base = al->al_tw_tick >> shift;
+    uint64_t *bm = al->al_tw_bitmap[level];
+
+    // A higher level slot we're already inside has been cascaded
+    const int k0 = al->al_tw_tick & ((1ULL << shift) - 1) ? 1 : 0;
+
+    while(1) {
+      int k = tw_bitmap_find(bm, (base + k0) & TW_LEVEL_MASK);
+      if(k == -1)
+        break;
+      k += k0;
+      const int slot = (base + k) & TW_LEVEL_MASK;
+      if(LIST_FIRST(&al->al_tw_slots[level][slot]) == NULL) {
+        bm[slot >> 6] &= ~(1ULL << (slot & 63));
+        continue;
+      }
+      const uint64_t tick = (base + k) << shift;
+      if(tick < best)
+        best = tick;
+      break;
+    }
+  }
+  return best;
+}
+
+
+/**
+ *
+ */
+static void
+tw_run_tick(asyncio_loop_t *al)
+{
+  const uint64_t tick = al->al_tw_tick;
+  asyncio_timer_t *at;
+  int level;
+
+  // Cascade from the highest level we're aligned to, so entries moving
+  // down one level are picked up by the next cascade
+  for(level = 1; level < TW_LEVELS; level++)
+    if(tick & ((1ULL << (level * TW_LEVEL_BITS)) - 1))
+      break;
+
+  for(level--; level > 0; level--) {
+    const int slot = (tick >> (level * TW_LEVEL_BITS)) & TW_LEVEL_MASK;
+    struct asyncio_timer_list *l = &al->al_tw_slots[level][slot];
+    al->al_tw_bitmap[level][slot >> 6] &= ~(1ULL << (slot & 63));
+    while((at = LIST_FIRST(l)) != NULL) {
+      LIST_REMOVE(at, at_link);
+      tw_insert(al, at);
+    }
+  }
+
+  const int slot = tick & TW_LEVEL_MASK;
+  struct asyncio_timer_list *l = &al->al_tw_slots[0][slot];
+  struct asyncio_timer_list tmplist;
+  LIST_INIT(&tmplist);
+  al->al_tw_bitmap[0][slot >> 6] &= ~(1ULL << (slot & 63));
+  while((at = LIST_FIRST(l)) != NULL) {
+    LIST_REMOVE(at, at_link);
+    LIST_INSERT_HEAD(&tmplist, at, at_link);
+  }
+
+  // Timers armed from callbacks must land on a later tick
+  al->al_tw_tick = tick + 1;
+
+  int64_t now = 0;
+  while((at = LIST_FIRST(&tmplist)) != NULL) {
+    LIST_REMOVE(at, at_link);
+    if(tw_expire_tick(at->at_expire) > tick) {
+      tw_insert(al, at);
+      continue;
+    }
+    if(now == 0)
+      now = asyncio_get_monotime();
+
+    const int64_t lag = MAX(now - at->at_expire, 0);
+    stats_hist_add(al->al_stats.timer_lag_hist, lag);
+    al->al_stats.timer_lag_max = MAX(al->al_stats.timer_lag_max, lag);
+
+    void (*fn)(void *opaque) = at->at_fn;
+    at->at_expire = 0;
+    fn(at->at_opaque);
+
+    const int64_t t0 = now;
+    now = asyncio_get_monotime();
+    loop_stats_callback(al, fn, now - t0);
+  }
+}
+
+
+/**
+ * Run all expired timers. Returns number of microseconds until the next
+ * timer is due or -1 if there are none
+ */
+static int64_t
+tw_step(asyncio_loop_t *al)
+{
+  const int64_t now = asyncio_get_monotime();
+  const uint64_t target = now >> TW_TICK_SHIFT;
+
+  while(al->al_tw_tick <= target) {
+    const uint64_t next = tw_next_tick(al);
+    if(next > target) {
+      al->al_tw_tick = target + 1;
+      break;
+    }
+    al->al_tw_tick = next;
+    tw_run_tick(al);
+  }
+
+  const uint64_t next = tw_next_tick(al);
+  __atomic_store_n(&al->al_tw_next, next, __ATOMIC_SEQ_CST);
+  if(next == TW_NEVER)
+    return -1;
+  return (int64_t)(next << TW_TICK_SHIFT) - now;
+}
+
+
+#ifdef __linux__
+/**
+ * epoll_wait() only has millisecond resolution, so deadlines closer
+ * than that are handed to a timerfd instead
+ */
+static int
+tw_epoll_timeout(asyncio_loop_t *al, int64_t timeout)
+{
+  if(timeout == -1)
+    return -1;
+
+  if(timeout >= 1000)
+    return MIN(timeout / 1000, INT32_MAX);
+
+  const uint64_t tick = al->al_tw_next;
+  if(tick != al->al_timerfd_tick) {
+    const uint64_t deadline = tick << TW_TICK_SHIFT;
+    struct itimerspec its = {
+      .it_value.tv_sec  = deadline / 1000000,
+      .it_value.tv_nsec = (deadline % 1000000) * 1000,
+    };
+    if(timerfd_settime(al->al_timerfd, TFD_TIMER_ABSTIME, &its, NULL))
+      return 1;
+    al->al_timerfd_tick = tick;
+  }
+  return -1;
+}
+
+
+/**
+ *
+ */
+static void
+asyncio_handle_timerfd(asyncio_fd_t *af)
+{
+  uint64_t expirations;
+  if(read(af->af_fd, &expirations, sizeof(expirations)) < 0)
+    return;
+  af->af_loop->al_timerfd_tick = 0;
+}
+#endif
+
+
+/**
+ *
+ */
+static void *
+asyncio_loop(void *aux)
+{
+  asyncio_loop_t *al = aux;
+  int r, i;
+
+  asyncio_current_loop = al;
+  set_thread_namef("asyncio/%d", al->al_id);
+
+  while(1) {
+    talloc_cleanup();
+
+    int64_t timeout;
+    do {
+      asyncio_timer_drain(al);
+      timeout = tw_step(al);
+    } while(__atomic_load_n(&al->al_timer_cmds, __ATOMIC_SEQ_CST) != NULL);
+
+#ifdef WITH_IO_URING
+    if(al->al_uring != NULL) {
+      uring_wait(al, timeout);
+      continue;
+    }
+#endif
+
+#ifdef __linux__
+
+    struct epoll_event ev[256];
+
+    const int epoll_timeout = tw_epoll_timeout(al, timeout);
+    loop_stats_wait_begin(al);
+    r = epoll_wait(al->al_epfd, ev, sizeof(ev) / sizeof(ev[0]),
+                   epoll_timeout);
+    loop_stats_wait_end(al, r);
+    if(r == -1) {
+      if(errno == EINTR)
+        continue;
+
+      perror("tcp_server: epoll_wait");
+      usleep(100000);
+      continue;
+    }
+
+    for(i = 0; i < r; i++) {
+      asyncio_fd_t *af = ev[i].data.ptr;
+      atomic_inc(&af->af_refcount);
+    }
+
+    for(i = 0; i < r; i++) {
+      asyncio_fd_t *af = ev[i].data.ptr;
+      void *fn = af_stats_fn(af);
+      const int64_t t0 = asyncio_get_monotime();
+      int events = ev[i].events;
+      if(af->af_flags & ASYNCIO_FLAG_EDGE_TRIGGERED)
+        events = et_filter_events(af, events);
+      asyncio_dispatch(af, events);
+      loop_stats_callback(al, fn, asyncio_get_monotime() - t0);
+    }
+    for(i = 0; i < r; i++) {
+      asyncio_fd_t *af = ev[i].data.ptr;
+      asyncio_fd_release(af);
+    }
+#endif
+
+
+#ifdef __APPLE__
+    struct kevent events[256];
+
+    struct timespec ts0, *ts = NULL;
+    if(timeout != -1) {
+      ts0.tv_sec = timeout / 1000000;
+      ts0.tv_nsec = (timeout % 1000000) * 1000LL;
+      ts = &ts0;
+    }
+
+    loop_stats_wait_begin(al);
+    r = kevent(al->al_epfd, NULL, 0, events,
+               sizeof(events) / sizeof(events[0]), ts);
+    loop_stats_wait_end(al, r);
+    if(r == -1) {
+      if(errno == EINTR)
         continue;
+      perror("kevent() poll");
+      usleep(100000);
+      continue;
+    }
+
+    for(i = 0; i < r; i++) {
+      asyncio_fd_t *af = events[i].udata;
+      atomic_inc(&af->af_refcount);
+    }
+
+    for(i = 0; i < r; i++) {
+      asyncio_fd_t *af = events[i].udata;
+      void *fn = af_stats_fn(af);
+      const int64_t t0 = asyncio_get_monotime();
+      if(events[i].filter == EVFILT_READ) {
+        af->af_pollin(af);
+
+        if(events[i].flags & EV_EOF) {
+          do_error(af, ECONNRESET);
+        }
+      }
+
+      if(events[i].filter == EVFILT_WRITE) {
+        if(events[i].flags & EV_EOF) {
+          do_error(af, ECONNRESET);
+        } else {
+          af->af_pollout(af);
+        }
+      }
+      loop_stats_callback(al, fn, asyncio_get_monotime() - t0);
+    }
+
+    for(i = 0; i < r; i++) {
+      asyncio_fd_t *af = events[i].udata;
+      asyncio_fd_release(af);
+    }
+
+#endif
+  }
+  return NULL;
+}
+
+
+/**
+ *
+ */
+static void
+asyncio_close_task(void *aux)
+{
+  asyncio_close(aux);
+}
+
+
+/**
+ *
+ */
+static void
+af_close_fd(asyncio_fd_t *af)
+{
+  mod_poll_flags(af, 0, -1);
+#ifdef WITH_IO_URING
+  // Queued requests refer to the fd number, get them in before closing
+  if(af->af_loop->al_uring != NULL)
+    uring_enter(af->af_loop->al_uring, 0, 0, NULL, 0);
+#endif
+  close(af->af_fd);
+  af->af_fd = -1;
+}
+
+
+/**
+ *
+ */
+void
+asyncio_close(asyncio_fd_t *af)
+{
+  assert(af->af_loop == asyncio_current_loop);
+
+  asyncio_fd_t *shard, *next;
+  for(shard = af->af_next_shard; shard != NULL; shard = next) {
+    next = shard->af_next_shard;
+    asyncio_loop_run_task(shard->af_loop, asyncio_close_task, shard, 0);
+  }
+  af->af_next_shard = NULL;
+
+  if(af->af_listener != NULL)
+    asyncio_timer_disarm(&af->af_listener->asl_timer);
+
+  if(af->af_dial != NULL) {
+    af->af_dial->ad_done = 1;
+    asyncio_timer_disarm(&af->af_dial->ad_timer);
+  }
+
+  af_lock(af);
+
+#if defined(WITH_OPENSSL)
+  if(af->af_ssl != NULL) {
+    SSL_free(af->af_ssl);
+    af->af_ssl = NULL;
+  }
+#endif
+
+  if(af->af_fd != -1)
+    af_close_fd(af);
+
+  if(af->af_flags & ASYNCIO_FLAG_THREAD_SAFE)
+    pthread_mutex_unlock(&af->af_sendq_mutex);
+  else
+    asyncio_fd_release(af);
+}
+
+
+/**
+ *
+ */
+void
+asyncio_shutdown(asyncio_fd_t *af)
+{
+  af_lock(af);
+
+  if(af->af_fd != -1) {
+    if(!af_sendq_empty(af)) {
+      af->af_pending_shutdown = 1;
+#if defined(WITH_OPENSSL)
+    } else if(af->af_ssl != NULL) {
+      SSL_shutdown(af->af_ssl);
+#endif
+    } else {
+      shutdown(af->af_fd, 2);
+    }
+  }
+  af_unlock(af);
+}
+
+/**
+ *
+ */
+static int
+af_plain_send(const asyncio_fd_t *af)
+{
+#if defined(WITH_OPENSSL)
+  return af->af_ssl == NULL || af->af_ktls_send;
+#else
+  return 1;
+#endif
+}
+
+
+/**
+ *
+ */
+static int
+send_locked_write(asyncio_fd_t *af)
+{
+  const int err = af->af_locked_write(af);
+  if(err) {
+    return -1;
+  }
+  return 0;
+}
+
+
+/**
+ *
+ */
+int
+asyncio_send(asyncio_fd_t *af, const void *buf, size_t len, int cork)
+{
+  int rval = 0;
+  af_lock(af);
+
+  if(af->af_fd != -1) {
+    mbuf_append(&af->af_sendq, buf, len);
+
+    if(!cork)
+      rval = send_locked_write(af);
+    if(rval == 0)
+      rval = af_check_high_watermark(af);
+  } else {
+    rval = -1;
+  }
+
+  af_unlock(af);
+  return rval;
+}
+
+
+/**
+ *
+ */
+int
+asyncio_send_with_hdr(asyncio_fd_t *af,
+                      const void *hdr_buf, size_t hdr_len,
+                      const void *buf, size_t len,
+                      int cork)
+{
+  int rval = 0;
+  af_lock(af);
+
+  const int no_ssl = af_plain_send(af);
+
+  if(af->af_fd != -1) {
+    int qempty = af_sendq_empty(af);
+
+    if(!cork && qempty && no_ssl) {
+      int r = send(af->af_fd, hdr_buf, hdr_len, MSG_NOSIGNAL | MSG_MORE);
+      if(r > 0) {
+        hdr_buf += r;
+        hdr_len -= r;
+        af->af_bytes_out += r;
+      }
+    }
+
+    if(hdr_len > 0) {
+      mbuf_append(&af->af_sendq, hdr_buf, hdr_len);
+      qempty = 0;
+    }
+
+    if(!cork && qempty && no_ssl) {
+      int r = send(af->af_fd, buf, len, MSG_NOSIGNAL);
+      if(r > 0) {
+        buf += r;
+        len -= r;
+        af->af_bytes_out += r;
+      }
+    }
+
+    if(len > 0) {
+      mbuf_append(&af->af_sendq, buf, len);
+      qempty = 0;
+    }
+
+    if(!cork)
+      rval = send_locked_write(af);
+    if(rval == 0)
+      rval = af_check_high_watermark(af);
+  } else {
+    rval = -1;
+  }
+
+  af_unlock(af);
+  return rval;
+}
+
+
+/**
+ *
+ */
+int
+asyncio_sendq(asyncio_fd_t *af, mbuf_t *q, int cork)
+{
+  int rval = 0;
+  af_lock(af);
+
+  if(af->af_fd != -1) {
+    mbuf_appendq(&af->af_sendq, q);
+    if(!cork)
+      rval = send_locked_write(af);
+    if(rval == 0)
+      rval = af_check_high_watermark(af);
+  } else {
+    mbuf_clear(q);
+    rval = 1;
+  }
+  af_unlock(af);
+  return rval;
+}
+
+
+/**
+ * Queue len bytes from fd starting at offset after whatever is already
+ * in the send queue. The fd is duplicated so the caller may close it
+ * right away. Plain sockets transmit the data with sendfile(), TLS
+ * sockets read and encrypt it in record sized chunks.
+ */
+int
+asyncio_sendfile(asyncio_fd_t *af, int fd, int64_t offset, int64_t len,
+                 int cork)
+{
+  if(len <= 0)
+    return 0;
+
+  int rval = 0;
+  af_lock(af);
+
+  if(af->af_fd != -1) {
+    asyncio_sendfile_t *asf = malloc(sizeof(asyncio_sendfile_t));
+    asf->asf_fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+    if(asf->asf_fd == -1) {
+      free(asf);
+      af_unlock(af);
+      return -1;
+    }
+    asf->asf_offset = offset;
+    asf->asf_len = len;
+    asf->asf_mbuf_bytes = af->af_sendq.mq_size - af->af_sendfile_marked;
+    af->af_sendfile_marked += asf->asf_mbuf_bytes;
+    af->af_sendfile_bytes += len;
+    TAILQ_INSERT_TAIL(&af->af_sendfiles, asf, asf_link);
+
+    if(!cork)
+      rval = send_locked_write(af);
+    if(rval == 0)
+      rval = af_check_high_watermark(af);
+  } else {
+    rval = -1;
+  }
+
+  af_unlock(af);
+  return rval;
+}
+
+
+/**
+ * Once more than high bytes are queued the asyncio_send* functions
+ * return ASYNCIO_SEND_BACKPRESSURE (the data is still queued). When
+ * the queue has drained to low bytes or less, cb(opaque) is invoked on
+ * the fd's loop. high = 0 disables.
+ */
+void
+asyncio_set_watermarks(asyncio_fd_t *af, size_t high, size_t low,
+                       asyncio_writable_cb_t *cb, void *opaque)
+{
+  af_lock(af);
+  af->af_sendq_high = high;
+  af->af_sendq_low = MIN(low, high);
+  af->af_writable = cb;
+  af->af_writable_opaque = opaque;
+  if(!high)
+    af->af_writable_armed = 0;
+  else
+    af_check_low_watermark(af);
+  af_unlock(af);
+}
+
+
+/**
+ *
+ */
+void
+asyncio_send_lock(asyncio_fd_t *af)
+{
+  af_lock(af);
+}
+
+
+/**
+ *
+ */
+void
+asyncio_send_unlock(asyncio_fd_t *af)
+{
+  af_unlock(af);
+}
+
+
+/**
+ *
+ */
+int
+asyncio_sendq_with_hdr_locked(asyncio_fd_t *af, const void *hdr_buf,
+                              size_t hdr_len, mbuf_t *q, int cork)
+{
+  int rval = 0;
+
+  const int no_ssl = af_plain_send(af);
+
+  if(af->af_fd != -1) {
+    int qempty = af_sendq_empty(af);
+
+    if(!cork && qempty && no_ssl) {
+      int r = send(af->af_fd, hdr_buf, hdr_len, MSG_NOSIGNAL | MSG_MORE);
+      if(r > 0) {
+        hdr_buf += r;
+        hdr_len -= r;
+        af->af_bytes_out += r;
+      }
+    }
+
+    if(hdr_len > 0) {
+      mbuf_append(&af->af_sendq, hdr_buf, hdr_len);
+      qempty = 0;
+    }
+    mbuf_appendq(&af->af_sendq, q);
+    if(!cork)
+      rval = send_locked_write(af);
+    if(rval == 0)
+      rval = af_check_high_watermark(af);
+  } else {
+    mbuf_clear(q);
+    rval = 1;
+  }
+
+  return rval;
+}
+
+
+/**
+ *
+ */
+int
+asyncio_sendq_with_hdr(asyncio_fd_t *af, const void *hdr_buf, size_t hdr_len,
+                       mbuf_t *q, int cork)
+{
+  if(af->af_flags & ASYNCIO_FLAG_THREAD_SAFE)
+    pthread_mutex_lock(&af->af_sendq_mutex);
+
+  int rval = asyncio_sendq_with_hdr_locked(af, hdr_buf, hdr_len, q, cork);
+  if(af->af_flags & ASYNCIO_FLAG_THREAD_SAFE)
+    pthread_mutex_unlock(&af->af_sendq_mutex);
+  return rval;
+}
+
+
+/**
+ *
+ */
+static int
+asyncio_bind_socket(const char *bindaddr, int port,
+                    const asyncio_bind_opts_t *opts)
+{
+  int fd, ret;
+  int one = 1;
+
+  fd = libsvc_socket(bindaddr == NULL ? AF_INET6 : AF_INET, SOCK_STREAM, 0);
+  if(fd == -1)
+    return -1;
+
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(int));
+
+  setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(int));
+
+  setup_tcp_socket(fd);
+
+  if(bindaddr == NULL) {
+    struct sockaddr_in6 la = {
+      .sin6_family = AF_INET6,
+      .sin6_port = htons(port)
+    };
+
+    ret = bind(fd, (struct sockaddr *)&la, sizeof(la));
+    if(ret < 0) {
+      int x = errno;
+      trace(LOG_ERR, "Unable to bind 0.0.0.0:%d -- %s",
+            port, strerror(errno));
+      close(fd);
+      errno = x;
+      return -1;
+    }
+
+    int off = 0;
+    setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof(int));
+
+  } else {
+    struct sockaddr_in la = {
+      .sin_family = AF_INET,
+      .sin_port = htons(port),
+      .sin_addr.s_addr = inet_addr(bindaddr)
+    };
+    ret = bind(fd, (struct sockaddr *)&la, sizeof(la));
+    if(ret < 0) {
+      int x = errno;
+      trace(LOG_ERR, "Unable to bind %s:%d -- %s",
+            bindaddr, port, strerror(errno));
+      close(fd);
+      errno = x;
+      return -1;
+    }
+  }
+
+#ifdef TCP_DEFER_ACCEPT
+  if(opts->defer_accept > 0)
+    setsockopt(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &opts->defer_accept,
+               sizeof(int));
+#endif
+
+#ifdef TCP_FASTOPEN
+  if(opts->fastopen > 0)
+    setsockopt(fd, IPPROTO_TCP, TCP_FASTOPEN, &opts->fastopen, sizeof(int));
+#endif
+
+  listen(fd, opts->backlog > 0 ? opts->backlog : 100);
+  return fd;
+}
+
+
+/**
+ * With multiple loops we open one SO_REUSEPORT socket per loop and let
+ * the kernel spread incoming connections. The returned fd is the
+ * listener on the first loop, closing it closes the others as well.
+ *
+ * The accept rate limit is split evenly between the loops.
+ */
+asyncio_fd_t *
+asyncio_bind_ex(const char *bindaddr, int port,
+                const asyncio_bind_opts_t *opts,
+                asyncio_accept_cb_t *cb,
+                void *opaque)
+{
+  asyncio_fd_t *first = NULL, **tailp = &first;
+
+  for(int i = 0; i < asyncio_num_loops; i++) {
+    int fd = asyncio_bind_socket(bindaddr, port, opts);
+    if(fd == -1) {
+      int x = errno;
+      asyncio_fd_t *af, *next;
+      for(af = first; af != NULL; af = next) {
+        next = af->af_next_shard;
+        af->af_next_shard = NULL;
+        asyncio_loop_run_task(af->af_loop, asyncio_close_task, af, 0);
+      }
+      errno = x;
+      return NULL;
+    }
+
+    asyncio_fd_t *af = asyncio_fd_create(asyncio_loops[i], fd, 0);
+#ifdef WITH_IO_URING
+    // Multishot accept drains the whole backlog before we see it, so
+    // rate limited listeners poll and accept via do_accept() instead
+    if(opts->max_accept_rate <= 0)
+      af->af_uring_in = URING_OP_ACCEPT;
+#endif
+    asyncio_listener_t *asl = calloc(1, sizeof(asyncio_listener_t));
+    asyncio_timer_init(&asl->asl_timer, listener_resume, af);
+    asl->asl_timer.at_loop = af->af_loop;
+    asl->asl_flags = opts->flags;
+    if(opts->max_accept_rate > 0) {
+      asl->asl_rate = MAX(1, opts->max_accept_rate / asyncio_num_loops);
+      asl->asl_tokens = asl->asl_rate;
+      asl->asl_refill = asyncio_get_monotime();
+    }
+    af->af_listener = asl;
+
+    af->af_pollin = &do_accept;
+    af->af_accept = cb;
+    af->af_opaque = opaque;
+    mod_poll_flags(af, EPOLLIN, 0);
+    *tailp = af;
+    tailp = &af->af_next_shard;
+  }
+  return first;
+}
+
+
+/**
+ *
+ */
+asyncio_fd_t *
+asyncio_bind(const char *bindaddr, int port,
+             asyncio_accept_cb_t *cb,
+             void *opaque)
+{
+  const asyncio_bind_opts_t opts = {
+    .flags = ASYNCIO_BIND_F_LOCAL_ADDR
+  };
+  return asyncio_bind_ex(bindaddr, port, &opts, cb, opaque);
+}
+
+
+/**
+ *
+ */
+asyncio_fd_t *
+asyncio_dgram(int fd,
+              asyncio_poll_cb_t *input,
+              void *opaque)
+{
+  set_nonblocking(fd, 1);
+  asyncio_fd_t *af = asyncio_fd_create(asyncio_pick_loop(), fd, EPOLLIN);
+  af->af_pollin  = input;
+  af->af_opaque = opaque;
+  return af;
+}
+
+
+/**
+ * Receive buffers for batched datagram fds are shared by all such fds
+ * on a loop since packets are only valid during the callback. Each
+ * slot can hold a full GRO coalesced packet.
+ */
+#define ASYNCIO_DGRAM_BATCH    32
+#define ASYNCIO_DGRAM_BUF_SIZE 65536
+#define ASYNCIO_DGRAM_ROUNDS   4     // recvmmsg() calls per wakeup
+#define ASYNCIO_DGRAM_GSO_SEGS 64    // Max segments per GSO send
+#define ASYNCIO_DGRAM_GSO_MAX  65000 // Max payload per GSO send
+#define ASYNCIO_DGRAM_IOV      128   // Packets per sendmmsg() call
+
+typedef struct asyncio_dgram_pool {
+  uint8_t adp_buf[ASYNCIO_DGRAM_BATCH][ASYNCIO_DGRAM_BUF_SIZE];
+  struct sockaddr_storage adp_addr[ASYNCIO_DGRAM_BATCH];
+  asyncio_dgram_packet_t adp_pkts[ASYNCIO_DGRAM_BATCH];
+#ifdef __linux__
+  struct mmsghdr adp_msgs[ASYNCIO_DGRAM_BATCH];
+  struct iovec adp_iov[ASYNCIO_DGRAM_BATCH];
+  char adp_cmsg[ASYNCIO_DGRAM_BATCH][CMSG_SPACE(sizeof(int))];
+#endif
+} asyncio_dgram_pool_t;
+
+
+/**
+ *
+ */
+static asyncio_dgram_pool_t *
+dgram_pool(asyncio_loop_t *al)
+{
+  if(al->al_dgram_pool == NULL)
+    al->al_dgram_pool = malloc(sizeof(asyncio_dgram_pool_t));
+  return al->al_dgram_pool;
+}
+
+
+#ifdef __linux__
+/**
+ * Segment size if the kernel coalesced several datagrams, else 0
+ */
+static size_t
+dgram_gro_size(struct msghdr *mh)
+{
+#ifdef UDP_GRO
+  struct cmsghdr *cm;
+  for(cm = CMSG_FIRSTHDR(mh); cm != NULL; cm = CMSG_NXTHDR(mh, cm)) {
+    if(cm->cmsg_level == IPPROTO_UDP && cm->cmsg_type == UDP_GRO) {
+      int size;
+      memcpy(&size, CMSG_DATA(cm), sizeof(size));
+      return size > 0 ? size : 0;
+    }
+  }
+#endif
+  return 0;
+}
+
+
+/**
+ * Fill the pool with up to a batch of datagrams. Returns number of
+ * messages received
+ */
+static int
+dgram_recv(asyncio_fd_t *af, asyncio_dgram_pool_t *adp)
+{
+  for(int i = 0; i < ASYNCIO_DGRAM_BATCH; i++) {
+    struct msghdr *mh = &adp->adp_msgs[i].msg_hdr;
+    adp->adp_iov[i].iov_base = adp->adp_buf[i];
+    adp->adp_iov[i].iov_len = ASYNCIO_DGRAM_BUF_SIZE;
+    mh->msg_name = &adp->adp_addr[i];
+    mh->msg_namelen = sizeof(adp->adp_addr[i]);
+    mh->msg_iov = &adp->adp_iov[i];
+    mh->msg_iovlen = 1;
+    mh->msg_control = adp->adp_cmsg[i];
+    mh->msg_controllen = sizeof(adp->adp_cmsg[i]);
+    mh->msg_flags = 0;
+  }
+  return recvmmsg(af->af_fd, adp->adp_msgs, ASYNCIO_DGRAM_BATCH,
+                  MSG_DONTWAIT, NULL);
+}
+#endif
+
+
+/**
+ *
+ */
+static void
+dgram_input(asyncio_fd_t *af)
+{
+  asyncio_dgram_pool_t *adp = dgram_pool(af->af_loop);
+  asyncio_dgram_packet_t *pkts = adp->adp_pkts;
+  int n = 0;
+
+  for(int round = 0; round < ASYNCIO_DGRAM_ROUNDS; round++) {
+#ifdef __linux__
+    const int r = dgram_recv(af, adp);
+#else
+    int r;
+    for(r = 0; r < ASYNCIO_DGRAM_BATCH; r++) {
+      socklen_t sl = sizeof(adp->adp_addr[r]);
+      ssize_t len = recvfrom(af->af_fd, adp->adp_buf[r],
+                             ASYNCIO_DGRAM_BUF_SIZE, MSG_DONTWAIT,
+                             (struct sockaddr *)&adp->adp_addr[r], &sl);
+      if(len < 0)
+        break;
+      pkts[r].data = adp->adp_buf[r];
+      pkts[r].len = len;
+      pkts[r].addr = (struct sockaddr *)&adp->adp_addr[r];
+      pkts[r].addrlen = sl;
+      af->af_bytes_in += len;
+    }
+    n = r;
+#endif
+    if(r <= 0)
+      return;
+
+#ifdef __linux__
+    for(int i = 0; i < r; i++) {
+      struct msghdr *mh = &adp->adp_msgs[i].msg_hdr;
+      const size_t len = adp->adp_msgs[i].msg_len;
+      const size_t seg = dgram_gro_size(mh) ?: len;
+      af->af_bytes_in += len;
+
+      // Split GRO packets back into the datagrams that were sent
+      size_t off = 0;
+      do {
+        if(n == ASYNCIO_DGRAM_BATCH) {
+          af->af_dgram_input(af->af_opaque, pkts, n);
+          n = 0;
+          if(af->af_fd == -1)
+            return;
+        }
+        pkts[n].data = adp->adp_buf[i] + off;
+        pkts[n].len = MIN(seg, len - off);
+        pkts[n].addr = mh->msg_name;
+        pkts[n].addrlen = mh->msg_namelen;
+        n++;
+        off += seg;
+      } while(off < len);
+    }
+#endif
+
+    if(n > 0)
+      af->af_dgram_input(af->af_opaque, pkts, n);
+    n = 0;
+
+    if(af->af_fd == -1 || r < ASYNCIO_DGRAM_BATCH)
+      return;
+  }
+}
 
-      perror("tcp_server: epoll_wait");
-      usleep(100000);
-      continue;
+
+/**
+ *
+ */
+asyncio_fd_t *
+asyncio_dgram_batch(int fd, asyncio_dgram_cb_t *input, void *opaque)
+{
+  set_nonblocking(fd, 1);
+
+#if defined(__linux__) && defined(UDP_GRO)
+  const int one = 1;
+  setsockopt(fd, IPPROTO_UDP, UDP_GRO, &one, sizeof(one));
+#endif
+
+  asyncio_fd_t *af = asyncio_fd_create(asyncio_pick_loop(), fd, EPOLLIN);
+  af->af_pollin = dgram_input;
+  af->af_dgram_input = input;
+  af->af_opaque = opaque;
+  return af;
+}
+
+
+#if defined(__linux__) && defined(UDP_SEGMENT)
+/**
+ * Number of packets starting at 'p' that can go out as a single GSO
+ * send: Same destination and size, except the last one may be shorter
+ */
+static int
+dgram_gso_run(const asyncio_dgram_packet_t *p, int count)
+{
+  const size_t seg = p[0].len;
+  size_t total = seg;
+  int n = 1;
+
+  if(seg == 0)
+    return 1;
+
+  while(n < count && n < ASYNCIO_DGRAM_GSO_SEGS &&
+        p[n].len > 0 && p[n].len <= seg &&
+        total + p[n].len <= ASYNCIO_DGRAM_GSO_MAX &&
+        p[n].addrlen == p[0].addrlen &&
+        (p[n].addr == p[0].addr ||
+         !memcmp(p[n].addr, p[0].addr, p[0].addrlen))) {
+    total += p[n].len;
+    if(p[n++].len < seg)
+      break;
+  }
+  return n;
+}
+#endif
+
+
+#ifdef __linux__
+/**
+ * Send one sendmmsg() worth of packets. Returns number of packets sent
+ * or -1 with errno set. '*all' is cleared if the kernel did not take
+ * every message
+ */
+static int
+dgram_send_batch(asyncio_fd_t *af, const asyncio_dgram_packet_t *pkts,
+                 int count, int *all, int *used_gso)
+{
+  struct mmsghdr msgs[ASYNCIO_DGRAM_BATCH];
+  struct iovec iov[ASYNCIO_DGRAM_IOV];
+  int npkts[ASYNCIO_DGRAM_BATCH];
+#ifdef UDP_SEGMENT
+  union {
+    char buf[CMSG_SPACE(sizeof(uint16_t))];
+    struct cmsghdr align;
+  } cmsg[ASYNCIO_DGRAM_BATCH];
+#endif
+  int m = 0, i = 0, niov = 0;
+
+  memset(msgs, 0, sizeof(msgs));
+  *used_gso = 0;
+
+  while(m < ASYNCIO_DGRAM_BATCH && i < count && niov < ASYNCIO_DGRAM_IOV) {
+    int n = 1;
+#ifdef UDP_SEGMENT
+    if(!af->af_dgram_no_gso)
+      n = MIN(dgram_gso_run(pkts + i, count - i), ASYNCIO_DGRAM_IOV - niov);
+#endif
+    struct msghdr *mh = &msgs[m].msg_hdr;
+    mh->msg_name = (void *)pkts[i].addr;
+    mh->msg_namelen = pkts[i].addrlen;
+    mh->msg_iov = iov + niov;
+    mh->msg_iovlen = n;
+
+    for(int j = 0; j < n; j++) {
+      iov[niov + j].iov_base = (void *)pkts[i + j].data;
+      iov[niov + j].iov_len = pkts[i + j].len;
     }
 
-    for(i = 0; i < r; i++) {
-      asyncio_fd_t *af = ev[i].data.ptr;
-      atomic_inc(&af->af_refcount);
+#ifdef UDP_SEGMENT
+    if(n > 1) {
+      const uint16_t segsize = pkts[i].len;
+      mh->msg_control = cmsg[m].buf;
+      mh->msg_controllen = sizeof(cmsg[m].buf);
+      struct cmsghdr *cm = CMSG_FIRSTHDR(mh);
+      cm->cmsg_level = IPPROTO_UDP;
+      cm->cmsg_type = UDP_SEGMENT;
+      cm->cmsg_len = CMSG_LEN(sizeof(segsize));
+      memcpy(CMSG_DATA(cm), &segsize, sizeof(segsize));
+      *used_gso = 1;
     }
+#endif
+    npkts[m++] = n;
+    niov += n;
+    i += n;
+  }
 
-    for(i = 0; i < r; i++) {
-      asyncio_fd_t *af = ev[i].data.ptr;
-      if(ev[i].events & EPOLLIN) {
-	af->af_pollin(af);
-      }
+  const int r = sendmmsg(af->af_fd, msgs, m, MSG_DONTWAIT | MSG_NOSIGNAL);
+  if(r < 0)
+    return -1;
 
-      if(ev[i].events & (EPOLLHUP | EPOLLERR) && af->af_pollerr != NULL) {
-	af->af_pollerr(af);
-	continue;
-      }
+  int sent = 0;
+  for(i = 0; i < r; i++) {
+    sent += npkts[i];
+    __atomic_fetch_add(&af->af_bytes_out, msgs[i].msg_len, __ATOMIC_RELAXED);
+  }
+  *all = r == m;
+  return sent;
+}
+#endif
 
-      if(ev[i].events & EPOLLHUP) {
-        do_error(af, ECONNRESET);
-        continue;
-      }
 
-      if(ev[i].events & EPOLLERR) {
-        do_error(af, ENOTCONN);
+/**
+ *
+ */
+int
+asyncio_dgram_send(asyncio_fd_t *af, const asyncio_dgram_packet_t *pkts,
+                   int count)
+{
+  int sent = 0;
+
+#ifdef __linux__
+  while(sent < count) {
+    int all, used_gso;
+    const int r = dgram_send_batch(af, pkts + sent, count - sent,
+                                   &all, &used_gso);
+    if(r == -1) {
+      // No GSO support in the kernel or on the route, go one by one
+      if(used_gso &&
+         (errno == EIO || errno == EINVAL || errno == ENOPROTOOPT ||
+          errno == EOPNOTSUPP)) {
+        af->af_dgram_no_gso = 1;
         continue;
       }
+      break;
+    }
+    sent += r;
+    if(!all)
+      break;
+  }
+#else
+  for(; sent < count; sent++) {
+    const asyncio_dgram_packet_t *p = pkts + sent;
+    if(sendto(af->af_fd, p->data, p->len, 0, p->addr, p->addrlen) < 0)
+      break;
+    __atomic_fetch_add(&af->af_bytes_out, p->len, __ATOMIC_RELAXED);
+  }
+#endif
+  if(sent == 0 && count > 0)
+    return -1;
+  return sent;
+}
 
-      if(ev[i].events & EPOLLOUT) {
-	af->af_pollout(af);
-      }
 
+/**
+ *
+ */
+asyncio_fd_t *
+asyncio_stream(int fd,
+               asyncio_read_cb_t *read,
+               asyncio_error_cb_t *err,
+               void *opaque,
+               int flags,
+               asyncio_sslctx_t *sslctx,
+               const char *hostname)
+{
+  int poll_flags = EPOLLIN;
+  if(fd != asyncio_accepted_fd)
+    setup_tcp_socket(fd);
+  asyncio_fd_t *af = asyncio_fd_create(asyncio_pick_loop(), fd, 0);
+
+#ifdef __linux__
+  if(asyncio_edge_triggered)
+    flags |= ASYNCIO_FLAG_EDGE_TRIGGERED;
+  // TLS needs its own read/write state tracking, keep it level triggered
+  if(sslctx != NULL)
+    flags &= ~ASYNCIO_FLAG_EDGE_TRIGGERED;
+#ifdef WITH_IO_URING
+  if(af->af_loop->al_uring != NULL)
+    flags &= ~ASYNCIO_FLAG_EDGE_TRIGGERED;
+#endif
+#else
+  flags &= ~ASYNCIO_FLAG_EDGE_TRIGGERED;
+#endif
+
+  af->af_flags = flags;
+  af->af_hostname = hostname ? strdup(hostname) : NULL;
+
+  if(flags & ASYNCIO_FLAG_THREAD_SAFE) {
+    pthread_mutex_init(&af->af_sendq_mutex, NULL);
+    pthread_cond_init(&af->af_sendq_cond, NULL);
+  }
+
+  if(sslctx != NULL) {
+#if defined(WITH_OPENSSL)
+
+    af->af_ssl = SSL_new(sslctx->ctx);
+    if(SSL_set_fd(af->af_ssl, fd) == 0) {
+      trace(LOG_ERR, "SSL: Unable to set FD");
     }
-    for(i = 0; i < r; i++) {
-      asyncio_fd_t *af = ev[i].data.ptr;
-      asyncio_fd_release(af);
+    SSL_set_app_data(af->af_ssl, af);
+
+    if(sslctx->client && hostname != NULL)
+      ssl_session_resume(af, hostname);
+
+    if(hostname != NULL)
+      SSL_set_tlsext_host_name(af->af_ssl, hostname);
+
+    SSL_set_mode(af->af_ssl,
+                 SSL_MODE_ENABLE_PARTIAL_WRITE |
+                 SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+
+    if(sslctx->client) {
+      SSL_set_connect_state(af->af_ssl);
+      poll_flags = EPOLLOUT;
+    } else {
+      SSL_set_accept_state(af->af_ssl);
     }
+
+    af->af_pollin  = &do_ssl_read;
+    af->af_locked_write = &do_ssl_write_locked;
+#else
+    trace(LOG_ERR, "SSL not enabled");
+    return NULL;
+#endif
+  } else {
+    af->af_pollin  = &do_read;
+    af->af_locked_write = &do_write_locked;
+#ifdef WITH_IO_URING
+    af->af_uring_in = URING_OP_RECV;
 #endif
+  }
 
+  af->af_pollout = &do_write_unlocked;
 
-#ifdef __APPLE__
-    struct kevent events[256];
+  af->af_bytes_avail = read;
+  af->af_error = err;
+  af->af_opaque = opaque;
+  mod_poll_flags(af, poll_flags, 0);
+  return af;
+}
 
-    struct timespec ts0, *ts = NULL;
-    if(timeout != -1) {
-      ts0.tv_sec = timeout / 1000;
-      ts0.tv_nsec = (timeout % 1000) * 1000000LL;
-      ts = &ts0;
+
+/**
+ *
+ */
+static void
+dial_finish(asyncio_fd_t *af, const char *msg)
+{
+  asyncio_dial_t *ad = af->af_dial;
+
+  ad->ad_done = 1;
+  asyncio_timer_disarm(&ad->ad_timer);
+  if(ad->ad_res != NULL) {
+    freeaddrinfo(ad->ad_res);
+    ad->ad_res = NULL;
+    ad->ad_next = NULL;
+  }
+  af->af_connect(af->af_opaque, msg);
+}
+
+
+/**
+ *
+ */
+static void
+dial_fail(asyncio_fd_t *af)
+{
+  asyncio_dial_t *ad = af->af_dial;
+  char *msg;
+
+  if(ad->ad_gai_err)
+    msg = fmt("Unable to resolve %s -- %s", af->af_hostname,
+              gai_strerror(ad->ad_gai_err));
+  else if(ad->ad_error == ETIMEDOUT)
+    msg = fmt("Connection to %s timed out", af->af_hostname);
+  else
+    msg = fmt("Connection to %s failed -- %s", af->af_hostname,
+              strerror(ad->ad_error));
+
+  dial_finish(af, msg);
+  free(msg);
+}
+
+
+static void dial_next(asyncio_fd_t *af);
+
+/**
+ *
+ */
+static void
+dial_pollout(asyncio_fd_t *af)
+{
+  asyncio_dial_t *ad = af->af_dial;
+  socklen_t len = sizeof(ad->ad_error);
+  struct sockaddr_storage ss;
+
+  if(getsockopt(af->af_fd, SOL_SOCKET, SO_ERROR, &ad->ad_error, &len))
+    ad->ad_error = errno;
+
+  if(!ad->ad_error) {
+    // Stale poll events for a previous attempt can get here
+    len = sizeof(ss);
+    if(getpeername(af->af_fd, (struct sockaddr *)&ss, &len)) {
+      if(errno == ENOTCONN)
+        return;
+      ad->ad_error = errno;
     }
+  }
 
-    r = kevent(epfd, NULL, 0, events, sizeof(events) / sizeof(events[0]), ts);
-    if(r == -1) {
-      if(errno == EINTR)
-        continue;
-      perror("kevent() poll");
-      usleep(100000);
+  if(ad->ad_error) {
+    af_close_fd(af);
+    dial_next(af);
+    return;
+  }
+
+  af->af_pollin = &do_read;
+  af->af_pollout = &do_write_unlocked;
+  af->af_pollerr = NULL;
+#ifdef WITH_IO_URING
+  af->af_uring_in = URING_OP_RECV;
+#endif
+  mod_poll_flags(af, EPOLLIN, af_sendq_empty(af) ? EPOLLOUT : 0);
+  dial_finish(af, NULL);
+}
+
+
+/**
+ * Start connecting to the next resolved address
+ */
+static void
+dial_next(asyncio_fd_t *af)
+{
+  asyncio_dial_t *ad = af->af_dial;
+  const struct addrinfo *ai;
+
+  while((ai = ad->ad_next) != NULL) {
+    ad->ad_next = ai->ai_next;
+
+    if(ai->ai_family != AF_INET && ai->ai_family != AF_INET6)
+      continue;
+
+    const int fd = libsvc_socket(ai->ai_family, SOCK_STREAM, 0);
+    if(fd == -1) {
+      ad->ad_error = errno;
       continue;
     }
+    setup_tcp_socket(fd);
 
-    for(i = 0; i < r; i++) {
-      asyncio_fd_t *af = events[i].udata;
-      atomic_inc(&af->af_refcount);
+    if(connect(fd, ai->ai_addr, ai->ai_addrlen) && errno != EINPROGRESS) {
+      ad->ad_error = errno;
+      close(fd);
+      continue;
     }
+    af->af_fd = fd;
+    mod_poll_flags(af, EPOLLOUT, 0);
+    return;
+  }
 
-    for(i = 0; i < r; i++) {
-      asyncio_fd_t *af = events[i].udata;
-      if(events[i].filter == EVFILT_READ) {
-        af->af_pollin(af);
+  if(!ad->ad_error)
+    ad->ad_error = EADDRNOTAVAIL;
+  dial_fail(af);
+}
 
-        if(events[i].flags & EV_EOF) {
-          do_error(af, ECONNRESET);
-        }
-      }
 
-      if(events[i].filter == EVFILT_WRITE) {
-        if(events[i].flags & EV_EOF) {
-          do_error(af, ECONNRESET);
-        } else {
-          af->af_pollout(af);
-        }
-      }
-    }
+/**
+ *
+ */
+static void
+dial_timeout(void *aux)
+{
+  asyncio_fd_t *af = aux;
 
-    for(i = 0; i < r; i++) {
-      asyncio_fd_t *af = events[i].udata;
-      asyncio_fd_release(af);
+  if(af->af_fd != -1)
+    af_close_fd(af);
+  af->af_dial->ad_error = ETIMEDOUT;
+  dial_fail(af);
+}
+
+
+/**
+ * Runs on the fd's loop once getaddrinfo() is done
+ */
+static void
+dial_resolved(void *aux)
+{
+  asyncio_fd_t *af = aux;
+  asyncio_dial_t *ad = af->af_dial;
+
+  if(!ad->ad_done) {
+    if(ad->ad_gai_err) {
+      dial_fail(af);
+    } else {
+      ad->ad_next = ad->ad_res;
+      dial_next(af);
     }
+  }
+  asyncio_fd_release(af);
+}
 
-#endif
+
+/**
+ * getaddrinfo() blocks so it's done on a task thread
+ */
+static void
+dial_resolve(void *aux)
+{
+  asyncio_fd_t *af = aux;
+  asyncio_dial_t *ad = af->af_dial;
+  const struct addrinfo hints = {
+    .ai_family = AF_UNSPEC,
+    .ai_socktype = SOCK_STREAM,
+    .ai_flags = AI_ADDRCONFIG,
+  };
+  char service[10];
+
+  snprintf(service, sizeof(service), "%u", af->af_port);
+  ad->ad_gai_err = getaddrinfo(af->af_hostname, service, &hints,
+                               &ad->ad_res);
+  if(ad->ad_gai_err)
+    ad->ad_res = NULL;
+  asyncio_loop_run_task(af->af_loop, dial_resolved, af, 0);
+}
+
+
+/**
+ * Arm the timeout from the loop so asyncio_close() can always cancel it
+ */
+static void
+dial_start(void *aux)
+{
+  asyncio_fd_t *af = aux;
+  asyncio_dial_t *ad = af->af_dial;
+
+  if(ad->ad_done) {
+    asyncio_fd_release(af);
+    return;
   }
-  return NULL;
+  if(ad->ad_timeout > 0)
+    asyncio_timer_arm_delta(&ad->ad_timer, ad->ad_timeout * 1000LL);
+  task_run(dial_resolve, af);
+}
+
+
+/**
+ *
+ */
+asyncio_fd_t *
+asyncio_connect(const char *hostname, int port, int timeout,
+                asyncio_connect_cb_t *cb,
+                asyncio_read_cb_t *read,
+                asyncio_error_cb_t *err,
+                void *opaque)
+{
+  asyncio_loop_t *al = asyncio_pick_loop();
+  asyncio_fd_t *af = asyncio_fd_create(al, -1, 0);
+  asyncio_dial_t *ad = calloc(1, sizeof(asyncio_dial_t));
+
+  af->af_dial = ad;
+  af->af_hostname = strdup(hostname);
+  af->af_port = port;
+  af->af_connect = cb;
+  af->af_bytes_avail = read;
+  af->af_error = err;
+  af->af_opaque = opaque;
+  // Refused connects may be reported as any of these
+  af->af_pollin = &dial_pollout;
+  af->af_pollout = &dial_pollout;
+  af->af_pollerr = &dial_pollout;
+  af->af_locked_write = &do_write_locked;
+
+  ad->ad_timeout = timeout;
+  asyncio_timer_init(&ad->ad_timer, dial_timeout, af);
+  ad->ad_timer.at_loop = al;
+
+  asyncio_fd_retain(af);
+  asyncio_loop_run_task(al, dial_start, af, 0);
+  return af;
 }
 
 
@@ -1080,582 +4029,816 @@ asyncio_loop(void *aux)
  *
  */
 void
-asyncio_close(asyncio_fd_t *af)
+asyncio_process_pending(asyncio_fd_t *af)
 {
-  assert(pthread_self() == asyncio_tid);
+  assert(af->af_loop == asyncio_current_loop);
 
-  af_lock(af);
+  if(af->af_recvq.mq_size)
+    af->af_bytes_avail(af->af_opaque, &af->af_recvq);
+}
 
-#if defined(WITH_OPENSSL)
-  if(af->af_ssl != NULL) {
-    SSL_free(af->af_ssl);
-    af->af_ssl = NULL;
-  }
+
+/**
+ * Consume the wakeup signal and run every worker that has been marked
+ * pending since last time
+ */
+static void
+asyncio_handle_wakeup(asyncio_fd_t *af)
+{
+  asyncio_loop_t *al = af->af_loop;
+#ifdef __linux__
+  uint64_t x;
+  if(read(af->af_fd, &x, sizeof(x)) < 0 && errno != EAGAIN)
+    return;
+#else
+  char buf[64];
+  while(read(af->af_fd, buf, sizeof(buf)) == sizeof(buf)) {}
 #endif
 
-  if(af->af_fd != -1) {
-    mod_poll_flags(af, 0, -1);
-    close(af->af_fd);
-    af->af_fd = -1;
+  uint64_t pending = __atomic_exchange_n(&al->al_workers_pending, 0,
+                                         __ATOMIC_SEQ_CST);
+  while(pending) {
+    const int id = __builtin_ctzll(pending);
+    pending &= pending - 1;
+    void (*fn)(void) = __atomic_load_n(&asyncio_workers[id],
+                                       __ATOMIC_ACQUIRE);
+    if(fn != NULL)
+      fn();
   }
-
-  if(af->af_flags & ASYNCIO_FLAG_THREAD_SAFE)
-    pthread_mutex_unlock(&af->af_sendq_mutex);
-  else
-    asyncio_fd_release(af);
 }
 
 
 /**
  *
  */
-void
-asyncio_shutdown(asyncio_fd_t *af)
+int
+asyncio_add_worker(void (*fn)(void))
 {
-  af_lock(af);
-
-  if(af->af_fd != -1) {
-    if(af->af_sendq.mq_size) {
-      af->af_pending_shutdown = 1;
-#if defined(WITH_OPENSSL)
-    } else if(af->af_ssl != NULL) {
-      SSL_shutdown(af->af_ssl);
-#endif
-    } else {
-      shutdown(af->af_fd, 2);
-    }
+  pthread_mutex_lock(&asyncio_worker_mutex);
+  const int id = ++asyncio_num_workers;
+  if(id >= ASYNCIO_MAX_WORKERS) {
+    fprintf(stderr, "asyncio: Too many workers\n");
+    abort();
   }
-  af_unlock(af);
+  __atomic_store_n(&asyncio_workers[id], fn, __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&asyncio_worker_mutex);
+  return id;
 }
 
+
 /**
  *
  */
-static int
-send_locked_write(asyncio_fd_t *af)
+static void
+timer_cb(void)
 {
-  const int err = af->af_locked_write(af);
-  if(err) {
-    return -1;
-  }
-  return 0;
+  asyncio_timer_drain(asyncio_current_loop);
 }
 
 
+#ifdef WITH_IO_URING
 /**
  *
  */
-int
-asyncio_send(asyncio_fd_t *af, const void *buf, size_t len, int cork)
+static void
+uring_cb(void)
 {
-  int rval = 0;
-  af_lock(af);
-
-  if(af->af_fd != -1) {
-    mbuf_append(&af->af_sendq, buf, len);
+  if(asyncio_current_loop->al_uring != NULL)
+    uring_drain_dirty(asyncio_current_loop);
+}
+#endif
 
-    if(!cork)
-      rval = send_locked_write(af);
-  } else {
-    rval = -1;
-  }
 
-  af_unlock(af);
-  return rval;
+/**
+ *
+ */
+static void
+asyncio_task_waiter_init(asyncio_task_waiter_t *atw)
+{
+  atw->atw_done = 0;
+#ifndef __linux__
+  pthread_mutex_init(&atw->atw_mutex, NULL);
+  pthread_cond_init(&atw->atw_cond, NULL);
+#endif
 }
 
 
 /**
  *
  */
-int
-asyncio_send_with_hdr(asyncio_fd_t *af,
-                      const void *hdr_buf, size_t hdr_len,
-                      const void *buf, size_t len,
-                      int cork)
+static void
+asyncio_task_waiter_wait(asyncio_task_waiter_t *atw)
 {
-  int rval = 0;
-  af_lock(af);
+#ifdef __linux__
+  while(!__atomic_load_n(&atw->atw_done, __ATOMIC_ACQUIRE))
+    syscall(SYS_futex, &atw->atw_done, FUTEX_WAIT_PRIVATE, 0,
+            NULL, NULL, 0);
+#else
+  pthread_mutex_lock(&atw->atw_mutex);
+  while(!atw->atw_done)
+    pthread_cond_wait(&atw->atw_cond, &atw->atw_mutex);
+  pthread_mutex_unlock(&atw->atw_mutex);
+  pthread_mutex_destroy(&atw->atw_mutex);
+  pthread_cond_destroy(&atw->atw_cond);
+#endif
+}
 
-#if defined(WITH_OPENSSL)
-  const int no_ssl = af->af_ssl == NULL;
+
+/**
+ * The waiter must not be touched after this as the caller may have
+ * returned
+ */
+static void
+asyncio_task_waiter_signal(asyncio_task_waiter_t *atw)
+{
+#ifdef __linux__
+  __atomic_store_n(&atw->atw_done, 1, __ATOMIC_RELEASE);
+  syscall(SYS_futex, &atw->atw_done, FUTEX_WAKE_PRIVATE, 1,
+          NULL, NULL, 0);
 #else
-  const int no_ssl = 1;
+  pthread_mutex_lock(&atw->atw_mutex);
+  atw->atw_done = 1;
+  pthread_cond_signal(&atw->atw_cond);
+  pthread_mutex_unlock(&atw->atw_mutex);
 #endif
+}
 
-  if(af->af_fd != -1) {
-    int qempty = af->af_sendq.mq_size == 0;
 
-    if(!cork && qempty && no_ssl) {
-      int r = send(af->af_fd, hdr_buf, hdr_len, MSG_NOSIGNAL | MSG_MORE);
-      if(r > 0) {
-        hdr_buf += r;
-        hdr_len -= r;
-      }
-    }
+/**
+ *
+ */
+static void
+asyncio_task_exec(void (*fn)(void *aux), void *aux,
+                  asyncio_task_waiter_t *atw)
+{
+  asyncio_loop_t *al = asyncio_current_loop;
+  const int64_t t0 = asyncio_get_monotime();
+  fn(aux);
+  if(al != NULL)
+    loop_stats_callback(al, fn, asyncio_get_monotime() - t0);
+  if(atw != NULL)
+    asyncio_task_waiter_signal(atw);
+}
 
-    if(hdr_len > 0) {
-      mbuf_append(&af->af_sendq, hdr_buf, hdr_len);
-      qempty = 0;
-    }
 
-    if(!cork && qempty && no_ssl) {
-      int r = send(af->af_fd, buf, len, MSG_NOSIGNAL);
-      if(r > 0) {
-        buf += r;
-        len -= r;
-      }
+/**
+ * Run tasks posted to the loop. To avoid starving IO we stop after
+ * a ring's worth of tasks and reschedule ourselves if there is more.
+ */
+static void
+task_cb(void)
+{
+  asyncio_loop_t *al = asyncio_current_loop;
+  int budget = ASYNCIO_TASK_RING_SIZE;
+
+  while(budget > 0) {
+    asyncio_task_slot_t *ats =
+      &al->al_task_ring[al->al_task_head & ASYNCIO_TASK_RING_MASK];
+
+    if(__atomic_load_n(&ats->ats_seq, __ATOMIC_ACQUIRE) ==
+       al->al_task_head + 1) {
+      void (*fn)(void *aux) = ats->ats_fn;
+      void *aux = ats->ats_aux;
+      asyncio_task_waiter_t *atw = ats->ats_waiter;
+      __atomic_store_n(&ats->ats_seq,
+                       al->al_task_head + ASYNCIO_TASK_RING_SIZE,
+                       __ATOMIC_RELEASE);
+      al->al_task_head++;
+      asyncio_task_exec(fn, aux, atw);
+      budget--;
+      continue;
     }
 
-    if(len > 0) {
-      mbuf_append(&af->af_sendq, buf, len);
-      qempty = 0;
+    if(!__atomic_load_n(&al->al_task_overflowed, __ATOMIC_ACQUIRE))
+      return;
+
+    pthread_mutex_lock(&al->al_task_mutex);
+    asyncio_task_t *at = TAILQ_FIRST(&al->al_task_overflow);
+    if(at != NULL) {
+      TAILQ_REMOVE(&al->al_task_overflow, at, at_link);
+      __atomic_sub_fetch(&al->al_task_overflowed, 1, __ATOMIC_RELEASE);
     }
+    pthread_mutex_unlock(&al->al_task_mutex);
+    if(at == NULL)
+      return;
 
-    if(!cork)
-      rval = send_locked_write(af);
-  } else {
-    rval = -1;
+    asyncio_task_exec(at->at_fn, at->at_aux, at->at_waiter);
+    free(at);
+    budget--;
   }
-
-  af_unlock(af);
-  return rval;
+  asyncio_loop_wakeup(al, asyncio_task_worker);
 }
 
 
 /**
  *
  */
-int
-asyncio_sendq(asyncio_fd_t *af, mbuf_t *q, int cork)
+static asyncio_loop_t *
+asyncio_loop_create(int id)
 {
-  int rval = 0;
-  af_lock(af);
+  asyncio_loop_t *al = calloc(1, sizeof(asyncio_loop_t));
+  al->al_id = id;
 
-  if(af->af_fd != -1) {
-    mbuf_appendq(&af->af_sendq, q);
-    if(!cork)
-      rval = send_locked_write(af);
-  } else {
-    mbuf_clear(q);
-    rval = 1;
+#ifdef __linux__
+  al->al_wakeup_fd[0] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if(al->al_wakeup_fd[0] == -1) {
+    perror("eventfd");
+    exit(1);
   }
-  af_unlock(af);
-  return rval;
-}
+  al->al_wakeup_fd[1] = al->al_wakeup_fd[0];
+#else
+  if(libsvc_pipe(al->al_wakeup_fd)) {
+    perror("pipe");
+    exit(1);
+  }
+  set_nonblocking(al->al_wakeup_fd[0], 1);
+  set_nonblocking(al->al_wakeup_fd[1], 1);
+#endif
 
+  al->al_task_ring = calloc(ASYNCIO_TASK_RING_SIZE,
+                            sizeof(asyncio_task_slot_t));
+  for(int i = 0; i < ASYNCIO_TASK_RING_SIZE; i++)
+    al->al_task_ring[i].ats_seq = i;
+  TAILQ_INIT(&al->al_task_overflow);
 
-/**
- *
- */
-void
-asyncio_send_lock(asyncio_fd_t *af)
-{
-  af_lock(af);
+#ifdef __linux__
+  al->al_epfd = epoll_create1(EPOLL_CLOEXEC);
+#endif
+
+#ifdef __APPLE__
+  al->al_epfd = kqueue();
+#endif
+
+  pthread_mutex_init(&al->al_task_mutex, NULL);
+
+#ifdef WITH_IO_URING
+  if(asyncio_use_uring) {
+    al->al_uring = uring_create();
+    if(al->al_uring == NULL)
+      trace(LOG_WARNING, "asyncio: Unable to use io_uring (%s), "
+            "falling back to epoll", strerror(errno));
+  }
+#endif
+
+  al->al_wakeup_af = asyncio_fd_create(al, al->al_wakeup_fd[0], EPOLLIN);
+  al->al_wakeup_af->af_pollin = &asyncio_handle_wakeup;
+
+  for(int i = 0; i < TW_LEVELS; i++)
+    for(int j = 0; j < TW_LEVEL_SLOTS; j++)
+      LIST_INIT(&al->al_tw_slots[i][j]);
+  al->al_tw_tick = asyncio_get_monotime() >> TW_TICK_SHIFT;
+
+#ifdef __linux__
+#ifdef WITH_IO_URING
+  // io_uring_enter() takes a precise timeout
+  if(al->al_uring != NULL)
+    return al;
+#endif
+  al->al_timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if(al->al_timerfd == -1) {
+    perror("timerfd_create");
+    exit(1);
+  }
+  asyncio_fd_t *af = asyncio_fd_create(al, al->al_timerfd, EPOLLIN);
+  af->af_pollin = &asyncio_handle_timerfd;
+#endif
+  return al;
 }
 
 
 /**
- *
+ * Number of loops is controlled by the "asyncio.threads" configuration
+ * value. 0 means one loop per online CPU. "asyncio.backend" can be set
+ * to "io_uring" to use io_uring instead of epoll where available.
  */
 void
-asyncio_send_unlock(asyncio_fd_t *af)
+asyncio_init(void)
 {
-  af_unlock(af);
-}
+  cfg_root(cr);
 
+  int num_loops = cfg_get_int(cr, CFG("asyncio", "threads"), 1);
+  if(num_loops <= 0)
+    num_loops = sysconf(_SC_NPROCESSORS_ONLN);
+  if(num_loops <= 0)
+    num_loops = 1;
 
-/**
- *
- */
-int
-asyncio_sendq_with_hdr_locked(asyncio_fd_t *af, const void *hdr_buf,
-                              size_t hdr_len, mbuf_t *q, int cork)
-{
-  int rval = 0;
+  asyncio_edge_triggered =
+    cfg_get_int(cr, CFG("asyncio", "edge_triggered"), 0);
 
-#if defined(WITH_OPENSSL)
-  const int no_ssl = af->af_ssl == NULL;
-#else
-  const int no_ssl = 1;
-#endif
+  pthread_mutex_init(&asyncio_worker_mutex, NULL);
 
-  if(af->af_fd != -1) {
-    int qempty = af->af_sendq.mq_size == 0;
+  asyncio_task_worker = asyncio_add_worker(task_cb);
+  asyncio_timer_worker = asyncio_add_worker(timer_cb);
 
-    if(!cork && qempty && no_ssl) {
-      int r = send(af->af_fd, hdr_buf, hdr_len, MSG_NOSIGNAL | MSG_MORE);
-      if(r > 0) {
-        hdr_buf += r;
-        hdr_len -= r;
-      }
-    }
+#ifdef WITH_IO_URING
+  const char *backend = cfg_get_str(cr, CFG("asyncio", "backend"), "epoll");
+  asyncio_use_uring = !strcmp(backend, "io_uring");
+  asyncio_uring_worker = asyncio_add_worker(uring_cb);
+#endif
 
-    if(hdr_len > 0) {
-      mbuf_append(&af->af_sendq, hdr_buf, hdr_len);
-      qempty = 0;
-    }
-    mbuf_appendq(&af->af_sendq, q);
-    if(!cork)
-      rval = send_locked_write(af);
-  } else {
-    mbuf_clear(q);
-    rval = 1;
-  }
+  asyncio_loops = calloc(num_loops, sizeof(asyncio_loop_t *));
+  for(int i = 0; i < num_loops; i++)
+    asyncio_loops[i] = asyncio_loop_create(i);
 
-  return rval;
+  asyncio_num_loops = num_loops;
+
+  for(int i = 0; i < num_loops; i++)
+    pthread_create(&asyncio_loops[i]->al_tid, NULL, asyncio_loop,
+                   asyncio_loops[i]);
 }
 
 
 /**
  *
  */
-int
-asyncio_sendq_with_hdr(asyncio_fd_t *af, const void *hdr_buf, size_t hdr_len,
-                       mbuf_t *q, int cork)
+int64_t
+asyncio_now(void)
 {
-  if(af->af_flags & ASYNCIO_FLAG_THREAD_SAFE)
-    pthread_mutex_lock(&af->af_sendq_mutex);
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return (int64_t)tv.tv_sec * 1000000LL + tv.tv_usec;
+}
 
-  int rval = asyncio_sendq_with_hdr_locked(af, hdr_buf, hdr_len, q, cork);
-  if(af->af_flags & ASYNCIO_FLAG_THREAD_SAFE)
-    pthread_mutex_unlock(&af->af_sendq_mutex);
-  return rval;
+
+/**
+ * Claim a slot in the task ring. Returns 0 if the ring is full
+ */
+static int
+asyncio_task_ring_push(asyncio_loop_t *al, void (*fn)(void *aux), void *aux,
+                       asyncio_task_waiter_t *atw)
+{
+  uint64_t pos = __atomic_load_n(&al->al_task_tail, __ATOMIC_RELAXED);
+  asyncio_task_slot_t *ats;
+
+  while(1) {
+    ats = &al->al_task_ring[pos & ASYNCIO_TASK_RING_MASK];
+    const uint64_t seq = __atomic_load_n(&ats->ats_seq, __ATOMIC_ACQUIRE);
+    const int64_t diff = (int64_t)(seq - pos);
+    if(diff == 0) {
+      if(__atomic_compare_exchange_n(&al->al_task_tail, &pos, pos + 1, 1,
+                                     __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        break;
+    } else if(diff < 0) {
+      return 0;
+    } else {
+      pos = __atomic_load_n(&al->al_task_tail, __ATOMIC_RELAXED);
+    }
+  }
+
+  ats->ats_fn = fn;
+  ats->ats_aux = aux;
+  ats->ats_waiter = atw;
+  __atomic_store_n(&ats->ats_seq, pos + 1, __ATOMIC_RELEASE);
+  return 1;
 }
 
 
 /**
  *
  */
-asyncio_fd_t *
-asyncio_bind(const char *bindaddr, int port,
-             asyncio_accept_cb_t *cb,
-             void *opaque)
+static void
+asyncio_loop_run_task(asyncio_loop_t *al, void (*fn)(void *aux), void *aux,
+                      int block)
 {
-  int fd, ret;
-  int one = 1;
-
-  fd = libsvc_socket(bindaddr == NULL ? AF_INET6 : AF_INET, SOCK_STREAM, 0);
-  if(fd == -1)
-    return NULL;
-
-  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(int));
-
-  setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(int));
-
-  setup_tcp_socket(fd);
-
-  if(bindaddr == NULL) {
-    struct sockaddr_in6 la = {
-      .sin6_family = AF_INET6,
-      .sin6_port = htons(port)
-    };
-
-    ret = bind(fd, (struct sockaddr *)&la, sizeof(la));
-    if(ret < 0) {
-      int x = errno;
-      trace(LOG_ERR, "Unable to bind 0.0.0.0:%d -- %s",
-            port, strerror(errno));
-      close(fd);
-      errno = x;
-      return NULL;
-    }
+  if(block && al == asyncio_current_loop) {
+    // Waiting for ourselves would deadlock
+    fn(aux);
+    return;
+  }
 
-    int off = 0;
-    setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof(int));
+  asyncio_task_waiter_t atw, *w = NULL;
+  if(block) {
+    asyncio_task_waiter_init(&atw);
+    w = &atw;
+  }
 
-  } else {
-    struct sockaddr_in la = {
-      .sin_family = AF_INET,
-      .sin_port = htons(port),
-      .sin_addr.s_addr = inet_addr(bindaddr)
-    };
-    ret = bind(fd, (struct sockaddr *)&la, sizeof(la));
-    if(ret < 0) {
-      int x = errno;
-      trace(LOG_ERR, "Unable to bind %s:%d -- %s",
-            bindaddr, port, strerror(errno));
-      close(fd);
-      errno = x;
-      return NULL;
-    }
+  if(__atomic_load_n(&al->al_task_overflowed, __ATOMIC_ACQUIRE) ||
+     !asyncio_task_ring_push(al, fn, aux, w)) {
+    asyncio_task_t *at = malloc(sizeof(asyncio_task_t));
+    at->at_fn = fn;
+    at->at_aux = aux;
+    at->at_waiter = w;
+    pthread_mutex_lock(&al->al_task_mutex);
+    TAILQ_INSERT_TAIL(&al->al_task_overflow, at, at_link);
+    __atomic_add_fetch(&al->al_task_overflowed, 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&al->al_task_mutex);
   }
 
-  listen(fd, 100);
+  asyncio_loop_wakeup(al, asyncio_task_worker);
 
-  asyncio_fd_t *af = asyncio_fd_create(fd, EPOLLIN);
-  af->af_pollin = &do_accept;
-  af->af_accept = cb;
-  af->af_opaque = opaque;
-  return af;
+  if(block)
+    asyncio_task_waiter_wait(&atw);
 }
 
-
 /**
  *
  */
-asyncio_fd_t *
-asyncio_dgram(int fd,
-              asyncio_poll_cb_t *input,
-              void *opaque)
+void
+asyncio_run_task(void (*fn)(void *aux), void *aux)
 {
-  set_nonblocking(fd, 1);
-  asyncio_fd_t *af = asyncio_fd_create(fd, EPOLLIN);
-  af->af_pollin  = input;
-  af->af_opaque = opaque;
-  return af;
+  asyncio_loop_run_task(asyncio_loops[0], fn, aux, 0);
 }
 
-
 /**
  *
  */
-asyncio_fd_t *
-asyncio_stream(int fd,
-               asyncio_read_cb_t *read,
-               asyncio_error_cb_t *err,
-               void *opaque,
-               int flags,
-               asyncio_sslctx_t *sslctx,
-               const char *hostname)
+void
+asyncio_run_task_blocking(void (*fn)(void *aux), void *aux)
 {
-  int poll_flags = EPOLLIN;
-  setup_tcp_socket(fd);
-  asyncio_fd_t *af = asyncio_fd_create(fd, 0);
+  asyncio_loop_run_task(asyncio_loops[0], fn, aux, 1);
+}
 
-  af->af_flags = flags;
-  af->af_hostname = hostname ? strdup(hostname) : NULL;
+/**
+ * Run task on the loop that owns the given fd
+ */
+void
+asyncio_fd_run_task(asyncio_fd_t *af, void (*fn)(void *aux), void *aux)
+{
+  asyncio_loop_run_task(af->af_loop, fn, aux, 0);
+}
 
-  if(flags & ASYNCIO_FLAG_THREAD_SAFE) {
-    pthread_mutex_init(&af->af_sendq_mutex, NULL);
-    pthread_cond_init(&af->af_sendq_cond, NULL);
-  }
+/************************************************************************
+ * SSL / TLS
+ ************************************************************************/
 
-  if(sslctx != NULL) {
 #if defined(WITH_OPENSSL)
 
-    af->af_ssl = SSL_new(sslctx->ctx);
-    if(SSL_set_fd(af->af_ssl, fd) == 0) {
-      trace(LOG_ERR, "SSL: Unable to set FD");
-    }
+/**
+ * Session ticket encryption keys, shared by all server contexts so
+ * tickets survive a certificate reload. Index 0 is used for new
+ * tickets and is replaced every asyncio.tls.ticket_key_lifetime
+ * seconds. Older keys are kept around to decrypt (and renew) tickets
+ * issued before the rotation.
+ */
+#ifdef ASYNCIO_TICKET_KEY_CB
 
-    if(hostname != NULL)
-      SSL_set_tlsext_host_name(af->af_ssl, hostname);
+#define ASYNCIO_TICKET_KEYS 3
 
-    SSL_set_mode(af->af_ssl,
-                 SSL_MODE_ENABLE_PARTIAL_WRITE |
-                 SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+typedef struct asyncio_ticket_key {
+  unsigned char atk_name[16];
+  unsigned char atk_aes[32];
+  unsigned char atk_hmac[32];
+  time_t atk_created;
+} asyncio_ticket_key_t;
 
-    if(sslctx->client) {
-      SSL_set_connect_state(af->af_ssl);
-      poll_flags = EPOLLOUT;
+static asyncio_ticket_key_t asyncio_ticket_keys[ASYNCIO_TICKET_KEYS];
+static int asyncio_num_ticket_keys;
+static int asyncio_ticket_key_lifetime;
+static pthread_mutex_t asyncio_ticket_key_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+
+/**
+ *
+ */
+static int
+ticket_key_find(const unsigned char *name, asyncio_ticket_key_t *out)
+{
+  const time_t now = time(NULL);
+  int r = -1;
+
+  pthread_mutex_lock(&asyncio_ticket_key_mutex);
+
+  if(asyncio_num_ticket_keys == 0 ||
+     now - asyncio_ticket_keys[0].atk_created >= asyncio_ticket_key_lifetime) {
+    memmove(asyncio_ticket_keys + 1, asyncio_ticket_keys,
+            sizeof(asyncio_ticket_key_t) * (ASYNCIO_TICKET_KEYS - 1));
+    asyncio_ticket_key_t *atk = &asyncio_ticket_keys[0];
+    if(RAND_bytes(atk->atk_name, sizeof(atk->atk_name)) == 1 &&
+       RAND_bytes(atk->atk_aes, sizeof(atk->atk_aes)) == 1 &&
+       RAND_bytes(atk->atk_hmac, sizeof(atk->atk_hmac)) == 1) {
+      atk->atk_created = now;
+      asyncio_num_ticket_keys = MIN(asyncio_num_ticket_keys + 1,
+                                    ASYNCIO_TICKET_KEYS);
     } else {
-      SSL_set_accept_state(af->af_ssl);
+      memmove(asyncio_ticket_keys, asyncio_ticket_keys + 1,
+              sizeof(asyncio_ticket_key_t) * (ASYNCIO_TICKET_KEYS - 1));
     }
-
-    af->af_pollin  = &do_ssl_read;
-    af->af_locked_write = &do_ssl_write_locked;
-#else
-    trace(LOG_ERR, "SSL not enabled");
-    return NULL;
-#endif
-  } else {
-    af->af_pollin  = &do_read;
-    af->af_locked_write = &do_write_locked;
   }
 
-  af->af_pollout = &do_write_unlocked;
-
-  af->af_bytes_avail = read;
-  af->af_error = err;
-  af->af_opaque = opaque;
-  mod_poll_flags(af, poll_flags, 0);
-  return af;
+  for(int i = 0; i < asyncio_num_ticket_keys; i++) {
+    if(name == NULL ||
+       !memcmp(name, asyncio_ticket_keys[i].atk_name,
+               sizeof(asyncio_ticket_keys[i].atk_name))) {
+      *out = asyncio_ticket_keys[i];
+      r = i;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&asyncio_ticket_key_mutex);
+  return r;
 }
 
 
 /**
  *
  */
-void
-asyncio_process_pending(asyncio_fd_t *af)
+static int
+ticket_key_cb(SSL *s, unsigned char key_name[16],
+              unsigned char iv[EVP_MAX_IV_LENGTH],
+              EVP_CIPHER_CTX *ctx, EVP_MAC_CTX *hctx, int enc)
 {
-  assert(pthread_self() == asyncio_tid);
+  asyncio_ticket_key_t atk;
+  const int idx = ticket_key_find(enc ? NULL : key_name, &atk);
+  if(idx == -1)
+    return enc ? -1 : 0; // Unknown key, do a full handshake
+
+  OSSL_PARAM params[] = {
+    OSSL_PARAM_construct_octet_string(OSSL_MAC_PARAM_KEY,
+                                      atk.atk_hmac, sizeof(atk.atk_hmac)),
+    OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST, "SHA256", 0),
+    OSSL_PARAM_construct_end()
+  };
+
+  if(enc) {
+    memcpy(key_name, atk.atk_name, sizeof(atk.atk_name));
+    if(RAND_bytes(iv, 16) != 1 ||
+       !EVP_EncryptInit_ex(ctx, EVP_aes_256_cbc(), NULL, atk.atk_aes, iv) ||
+       !EVP_MAC_CTX_set_params(hctx, params))
+      return -1;
+    return 1;
+  }
 
-  if(af->af_recvq.mq_size)
-    af->af_bytes_avail(af->af_opaque, &af->af_recvq);
+  if(!EVP_DecryptInit_ex(ctx, EVP_aes_256_cbc(), NULL, atk.atk_aes, iv) ||
+     !EVP_MAC_CTX_set_params(hctx, params))
+    return -1;
+
+  // Ask for a new ticket if this one was made with an older key
+  return idx == 0 ? 1 : 2;
 }
+#endif
 
 
 /**
- *
+ * Server side session cache and tickets.
  */
 static void
-asyncio_handle_pipe(asyncio_fd_t *af)
+sslctx_setup_server_sessions(SSL_CTX *ctx)
 {
-  char x;
-  if(read(asyncio_pipe[0], &x, 1) != 1)
-    return;
+  cfg_root(cr);
+
+  static const unsigned char sid_ctx[] = "libsvc";
+  SSL_CTX_set_session_id_context(ctx, sid_ctx, sizeof(sid_ctx) - 1);
+  SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER);
+  SSL_CTX_sess_set_cache_size(ctx,
+                              cfg_get_int(cr, CFG("asyncio", "tls",
+                                                  "session_cache_size"),
+                                          20480));
+  SSL_CTX_set_timeout(ctx, cfg_get_int(cr, CFG("asyncio", "tls",
+                                               "session_timeout"), 3600));
+
+#ifdef ASYNCIO_TICKET_KEY_CB
+  pthread_mutex_lock(&asyncio_ticket_key_mutex);
+  asyncio_ticket_key_lifetime =
+    MAX(1, cfg_get_int(cr, CFG("asyncio", "tls", "ticket_key_lifetime"),
+                       3600));
+  pthread_mutex_unlock(&asyncio_ticket_key_mutex);
+  SSL_CTX_set_tlsext_ticket_key_evp_cb(ctx, ticket_key_cb);
+#endif
+}
 
-  asyncio_worker_t *aw;
-  pthread_mutex_lock(&asyncio_worker_mutex);
 
-  LIST_FOREACH(aw, &asyncio_workers, link)
-    if(aw->id == x)
-      break;
+/**
+ * Client sessions, most recently used first. Keyed on hostname:port
+ * of the peer so they can be reused by any client context.
+ */
+#define ASYNCIO_SSL_CLIENT_SESSIONS 256
 
-  pthread_mutex_unlock(&asyncio_worker_mutex);
+typedef struct asyncio_ssl_session {
+  TAILQ_ENTRY(asyncio_ssl_session) ass_link;
+  char *ass_key;
+  SSL_SESSION *ass_session;
+} asyncio_ssl_session_t;
 
-  if(aw != NULL)
-    aw->fn();
-}
+TAILQ_HEAD(asyncio_ssl_session_queue, asyncio_ssl_session);
+
+static struct asyncio_ssl_session_queue asyncio_ssl_sessions =
+  TAILQ_HEAD_INITIALIZER(asyncio_ssl_sessions);
+static int asyncio_num_ssl_sessions;
+static pthread_mutex_t asyncio_ssl_session_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 
 /**
  *
  */
-int
-asyncio_add_worker(void (*fn)(void))
+static asyncio_ssl_session_t *
+ssl_session_find(const char *key)
 {
-  asyncio_worker_t *aw = calloc(1, sizeof(asyncio_worker_t));
-
-  aw->fn = fn;
-
-  static  int generator;
-
-  pthread_mutex_lock(&asyncio_worker_mutex);
-  generator++;
-  aw->id = generator;
-  LIST_INSERT_HEAD(&asyncio_workers, aw, link);
-  pthread_mutex_unlock(&asyncio_worker_mutex);
-  return aw->id;
+  asyncio_ssl_session_t *ass;
+  TAILQ_FOREACH(ass, &asyncio_ssl_sessions, ass_link) {
+    if(!strcmp(ass->ass_key, key)) {
+      TAILQ_REMOVE(&asyncio_ssl_sessions, ass, ass_link);
+      TAILQ_INSERT_HEAD(&asyncio_ssl_sessions, ass, ass_link);
+      return ass;
+    }
+  }
+  return NULL;
 }
 
 
 /**
- *
+ * Called by OpenSSL when the server hands us a new session
  */
-static void
-task_cb(void)
+static int
+ssl_session_new_cb(SSL *ssl, SSL_SESSION *sess)
 {
-  pthread_mutex_lock(&asyncio_task_mutex);
-  while(1) {
-    asyncio_task_t *at;
-    at = TAILQ_FIRST(&asyncio_tasks);
-    if(at != NULL)
-      TAILQ_REMOVE(&asyncio_tasks, at, at_link);
-    if(at == NULL)
-      break;
-    pthread_mutex_unlock(&asyncio_task_mutex);
-    at->at_fn(at->at_aux);
-    pthread_mutex_lock(&asyncio_task_mutex);
-    if(at->at_block) {
-      at->at_block = 0;
-      pthread_cond_broadcast(&asyncio_task_cond);
+  const asyncio_fd_t *af = SSL_get_app_data(ssl);
+  if(af == NULL || af->af_ssl_session_key == NULL)
+    return 0;
+
+  pthread_mutex_lock(&asyncio_ssl_session_mutex);
+  asyncio_ssl_session_t *ass = ssl_session_find(af->af_ssl_session_key);
+  if(ass != NULL) {
+    SSL_SESSION_free(ass->ass_session);
+  } else {
+    if(asyncio_num_ssl_sessions == ASYNCIO_SSL_CLIENT_SESSIONS) {
+      ass = TAILQ_LAST(&asyncio_ssl_sessions, asyncio_ssl_session_queue);
+      TAILQ_REMOVE(&asyncio_ssl_sessions, ass, ass_link);
+      SSL_SESSION_free(ass->ass_session);
+      free(ass->ass_key);
     } else {
-      free(at);
+      ass = malloc(sizeof(asyncio_ssl_session_t));
+      asyncio_num_ssl_sessions++;
     }
+    ass->ass_key = strdup(af->af_ssl_session_key);
+    TAILQ_INSERT_HEAD(&asyncio_ssl_sessions, ass, ass_link);
   }
-  pthread_mutex_unlock(&asyncio_task_mutex);
+  ass->ass_session = sess;
+  pthread_mutex_unlock(&asyncio_ssl_session_mutex);
+  return 1; // We keep the reference
 }
 
 
 /**
- *
+ * Try to resume a previous session with the same peer
  */
-void
-asyncio_init(void)
+static void
+ssl_session_resume(asyncio_fd_t *af, const char *hostname)
 {
-  if(pipe(asyncio_pipe)) {
-    perror("pipe");
+  struct sockaddr_storage ss;
+  socklen_t slen = sizeof(ss);
+  if(getpeername(af->af_fd, (struct sockaddr *)&ss, &slen))
     return;
-  }
-  fcntl(asyncio_pipe[0], F_SETFD, fcntl(asyncio_pipe[0], F_GETFD) | FD_CLOEXEC);
-  fcntl(asyncio_pipe[1], F_SETFD, fcntl(asyncio_pipe[1], F_GETFD) | FD_CLOEXEC);
 
-  TAILQ_INIT(&asyncio_tasks);
+  const int port = ntohs(ss.ss_family == AF_INET6 ?
+                         ((struct sockaddr_in6 *)&ss)->sin6_port :
+                         ((struct sockaddr_in *)&ss)->sin_port);
+  af->af_ssl_session_key = fmt("%s:%d", hostname, port);
 
-#ifdef __linux__
-  epfd = epoll_create1(EPOLL_CLOEXEC);
-#endif
+  pthread_mutex_lock(&asyncio_ssl_session_mutex);
+  asyncio_ssl_session_t *ass = ssl_session_find(af->af_ssl_session_key);
+  if(ass != NULL)
+    SSL_set_session(af->af_ssl, ass->ass_session);
+  pthread_mutex_unlock(&asyncio_ssl_session_mutex);
+}
 
-#ifdef __APPLE__
-  epfd = kqueue();
-#endif
 
-  pthread_mutex_init(&asyncio_worker_mutex, NULL);
-  pthread_mutex_init(&asyncio_task_mutex, NULL);
-  pthread_cond_init(&asyncio_task_cond, NULL);
+/**
+ *
+ */
+void
+asyncio_get_tls_stats(asyncio_tls_stats_t *stats)
+{
+  stats->handshakes =
+    __atomic_load_n(&asyncio_tls_stats.handshakes, __ATOMIC_RELAXED);
+  stats->resumed =
+    __atomic_load_n(&asyncio_tls_stats.resumed, __ATOMIC_RELAXED);
+  stats->failed =
+    __atomic_load_n(&asyncio_tls_stats.failed, __ATOMIC_RELAXED);
+  stats->handshake_cpu_us =
+    __atomic_load_n(&asyncio_tls_stats.handshake_cpu_us, __ATOMIC_RELAXED);
+}
 
-  asyncio_task_worker = asyncio_add_worker(task_cb);
 
-  pipe_af = asyncio_fd_create(asyncio_pipe[0], EPOLLIN);
-  pipe_af->af_pollin = &asyncio_handle_pipe;
+#endif
+
 
-  pthread_create(&asyncio_tid, NULL, asyncio_loop, NULL);
+/**
+ *
+ */
+void
+asyncio_fd_get_stats(asyncio_fd_t *af, asyncio_fd_stats_t *stats)
+{
+  stats->bytes_in = af->af_bytes_in;
+  stats->bytes_out = af->af_bytes_out;
+  stats->sendq_peak = af->af_sendq_peak;
 }
 
 
 /**
  *
  */
-int64_t
-asyncio_now(void)
+int
+asyncio_get_num_loops(void)
 {
-  struct timeval tv;
-  gettimeofday(&tv, NULL);
-  return (int64_t)tv.tv_sec * 1000000LL + tv.tv_usec;
+  return asyncio_num_loops;
 }
 
 
 /**
  *
  */
-static void
-asyncio_run_task0(void (*fn)(void *aux), void *aux, int block)
+int
+asyncio_get_loop_stats(int id, asyncio_loop_stats_t *stats)
 {
-  asyncio_task_t *at = malloc(sizeof(asyncio_task_t));
-  at->at_fn = fn;
-  at->at_aux = aux;
-  at->at_block = block;
-  pthread_mutex_lock(&asyncio_task_mutex);
-  TAILQ_INSERT_TAIL(&asyncio_tasks, at, at_link);
-  pthread_mutex_unlock(&asyncio_task_mutex);
-  asyncio_wakeup_worker(asyncio_task_worker);
+  if(id < 0 || id >= asyncio_num_loops)
+    return -1;
+  *stats = asyncio_loops[id]->al_stats;
+  return 0;
+}
 
-  if(block) {
 
-    pthread_mutex_lock(&asyncio_task_mutex);
-    while(at->at_block)
-      pthread_cond_wait(&asyncio_task_cond, &asyncio_task_mutex);
-    pthread_mutex_unlock(&asyncio_task_mutex);
-    free(at);
+/**
+ * Upper bound of the bucket containing the q:th quantile
+ */
+uint64_t
+asyncio_stats_percentile(const uint64_t *hist, double q)
+{
+  uint64_t total = 0, sum = 0;
+  for(int i = 0; i < ASYNCIO_STATS_BUCKETS; i++)
+    total += hist[i];
+  if(total == 0)
+    return 0;
+
+  const uint64_t target = MAX(1, (uint64_t)(q * total));
+  for(int i = 0; i < ASYNCIO_STATS_BUCKETS; i++) {
+    sum += hist[i];
+    if(sum >= target)
+      return 1ULL << i;
   }
+  return 1ULL << (ASYNCIO_STATS_BUCKETS - 1);
 }
 
+
 /**
  *
  */
-void
-asyncio_run_task(void (*fn)(void *aux), void *aux)
+static int
+show_asyncio(const char *user,
+             int argc, const char **argv, int *intv,
+             void (*msg)(void *opaque, const char *fmt, ...),
+             void *opaque)
 {
-   asyncio_run_task0(fn, aux, 0);
+  asyncio_loop_stats_t st;
+
+  for(int id = 0; asyncio_get_loop_stats(id, &st) == 0; id++) {
+    const uint64_t total = st.busy_us + st.wait_us;
+    msg(opaque, "Loop %d: %"PRIu64" iterations, %"PRIu64" events, "
+        "%"PRIu64" callbacks, %"PRIu64" poll updates, %.1f%% busy",
+        id, st.iterations, st.events, st.callbacks, st.poll_updates,
+        total ? 100.0 * st.busy_us / total : 0.0);
+
+    msg(opaque, "  Iteration us  p50 <%-8"PRIu64" p99 <%"PRIu64,
+        asyncio_stats_percentile(st.busy_hist, 0.5),
+        asyncio_stats_percentile(st.busy_hist, 0.99));
+    msg(opaque, "  Wait us       p50 <%-8"PRIu64" p99 <%"PRIu64,
+        asyncio_stats_percentile(st.wait_hist, 0.5),
+        asyncio_stats_percentile(st.wait_hist, 0.99));
+    msg(opaque, "  Events/wakeup p50 <%-8"PRIu64" p99 <%"PRIu64,
+        asyncio_stats_percentile(st.events_hist, 0.5),
+        asyncio_stats_percentile(st.events_hist, 0.99));
+    msg(opaque, "  Timer lag us  p50 <%-8"PRIu64" p99 <%-8"PRIu64
+        " max %"PRIu64,
+        asyncio_stats_percentile(st.timer_lag_hist, 0.5),
+        asyncio_stats_percentile(st.timer_lag_hist, 0.99),
+        st.timer_lag_max);
+
+    for(int i = 0; i < ASYNCIO_STATS_SLOWEST && st.slowest[i].fn; i++) {
+      Dl_info dli = {};
+      dladdr(st.slowest[i].fn, &dli);
+      msg(opaque, "  %10"PRIu64" us  %p %s", st.slowest[i].us,
+          st.slowest[i].fn, dli.dli_sname ?: "");
+    }
+  }
+
+#if defined(WITH_OPENSSL)
+  asyncio_tls_stats_t ts;
+  asyncio_get_tls_stats(&ts);
+  msg(opaque, "TLS: %"PRIu64" handshakes, %"PRIu64" resumed, "
+      "%"PRIu64" failed, %"PRIu64" us CPU",
+      ts.handshakes, ts.resumed, ts.failed, ts.handshake_cpu_us);
+#endif
+  return 0;
 }
 
+CMD(show_asyncio,
+    CMD_LITERAL("show"),
+    CMD_LITERAL("asyncio"));
+
+
+#if defined(WITH_OPENSSL)
 /**
- *
+ * Let OpenSSL hand record encryption to the kernel once the handshake
+ * is done. If the kernel or cipher does not support it OpenSSL quietly
+ * keeps doing it itself.
  */
-void
-asyncio_run_task_blocking(void (*fn)(void *aux), void *aux)
+static void
+sslctx_enable_ktls(SSL_CTX *ctx)
 {
-  asyncio_run_task0(fn, aux, 1);
+#ifdef ASYNCIO_KTLS
+  SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+#endif
 }
 
-/************************************************************************
- * SSL / TLS
- ************************************************************************/
-
-#if defined(WITH_OPENSSL)
 
 asyncio_sslctx_t *
 asyncio_sslctx_server_from_files(const char *priv_key_file,
@@ -1684,8 +4867,11 @@ asyncio_sslctx_server_from_files(const char *priv_key_file,
                       SSL_OP_NO_SSLv2 |
                       SSL_OP_NO_SSLv3 |
                       SSL_OP_NO_TLSv1);
+  sslctx_enable_ktls(ctx);
+  sslctx_setup_server_sessions(ctx);
 
   asyncio_sslctx_t *ret = calloc(1, sizeof(asyncio_sslctx_t));
+  atomic_set(&ret->refcount, 1);
   ret->ctx = ctx;
   return ret;
 }
@@ -1750,16 +4936,28 @@ asyncio_sslctx_server_from_pem(const char *priv_key_pem,
                       SSL_OP_NO_SSLv2 |
                       SSL_OP_NO_SSLv3 |
                       SSL_OP_NO_TLSv1);
+  sslctx_enable_ktls(ctx);
+  sslctx_setup_server_sessions(ctx);
 
   asyncio_sslctx_t *ret = calloc(1, sizeof(asyncio_sslctx_t));
+  atomic_set(&ret->refcount, 1);
   ret->ctx = ctx;
   return ret;
 }
 
 
+void
+asyncio_sslctx_retain(asyncio_sslctx_t *ctx)
+{
+  atomic_inc(&ctx->refcount);
+}
+
+
 void
 asyncio_sslctx_free(asyncio_sslctx_t *ctx)
 {
+  if(atomic_dec(&ctx->refcount))
+    return;
   SSL_CTX_free(ctx->ctx);
   free(ctx);
 }
@@ -1780,8 +4978,14 @@ asyncio_sslctx_client(void)
   }
 
   SSL_CTX_set_verify_depth(ctx, 3);
+  sslctx_enable_ktls(ctx);
+
+  SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_CLIENT |
+                                 SSL_SESS_CACHE_NO_INTERNAL_STORE);
+  SSL_CTX_sess_set_new_cb(ctx, ssl_session_new_cb);
 
   asyncio_sslctx_t *ret = calloc(1, sizeof(asyncio_sslctx_t));
+  atomic_set(&ret->refcount, 1);
   ret->client = 1;
   ret->ctx = ctx;
   return ret;
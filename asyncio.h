@@ -36,8 +36,24 @@ typedef struct asyncio_timer {
   int64_t at_expire;
   void (*at_fn)(void *opaque);
   void *at_opaque;
+  struct asyncio_loop *at_loop;
+
+  // Arm/disarm requests from other threads
+  struct asyncio_timer *at_cmd_next;
+  int64_t at_cmd_expire;
+  int at_cmd_queued;
 } asyncio_timer_t;
 
+/**
+ * Timers belong to the loop they were initialized on (loop 0 if not
+ * initialized from a loop thread) and callbacks always run there.
+ *
+ * Arming and disarming may be done from any thread. Requests from other
+ * threads are queued and applied by the owning loop before it goes back
+ * to sleep. The timer must stay allocated until such a request has been
+ * applied.
+ */
+
 void asyncio_timer_init(asyncio_timer_t *at, void (*fn)(void *opaque),
 			void *opque);
 
@@ -53,6 +69,7 @@ int64_t asyncio_now(void);
 
 #define ASYNCIO_FLAG_THREAD_SAFE     0x1
 #define ASYNCIO_FLAG_SSL_VERIFY_CERT 0x2
+#define ASYNCIO_FLAG_EDGE_TRIGGERED  0x4 // epoll only, ignored for TLS
 
 typedef struct asyncio_sslctx asyncio_sslctx_t;
 
@@ -72,11 +89,41 @@ typedef void (asyncio_read_cb_t)(void *opaque, struct mbuf *hq);
 
 typedef void (asyncio_poll_cb_t)(struct asyncio_fd *);
 
+typedef void (asyncio_writable_cb_t)(void *opaque);
+
 asyncio_fd_t *asyncio_bind(const char *bindaddr,
                          int port,
                          asyncio_accept_cb_t *cb,
                          void *opaque);
 
+#define ASYNCIO_BIND_F_LOCAL_ADDR 0x1 // Pass local address to accept cb
+
+typedef struct asyncio_bind_opts {
+  int flags;
+  int backlog;         // listen() backlog, 0 for default
+  int defer_accept;    // TCP_DEFER_ACCEPT timeout in seconds, 0 for off
+  int fastopen;        // TCP_FASTOPEN queue length, 0 for off
+  int max_accept_rate; // Connections per second, 0 for unlimited
+} asyncio_bind_opts_t;
+
+/**
+ * Like asyncio_bind() but the accept callback gets a NULL local address
+ * unless ASYNCIO_BIND_F_LOCAL_ADDR is set
+ */
+asyncio_fd_t *asyncio_bind_ex(const char *bindaddr,
+                              int port,
+                              const asyncio_bind_opts_t *opts,
+                              asyncio_accept_cb_t *cb,
+                              void *opaque);
+
+/**
+ * Resolve 'hostname' on a task thread and connect to each of its
+ * addresses in turn without blocking. 'cb' is invoked on the fd's loop
+ * with msg set to NULL once connected, or to an error message if
+ * resolving or connecting failed or 'timeout' (ms, whole operation)
+ * expired. The fd must be closed with asyncio_close() in either case.
+ * Nothing can be sent before the callback has reported success.
+ */
 asyncio_fd_t *asyncio_connect(const char *hostname,
 			    int port, int timeout,
 			    asyncio_connect_cb_t *cb,
@@ -87,6 +134,35 @@ asyncio_fd_t *asyncio_connect(const char *hostname,
 asyncio_fd_t *asyncio_dgram(int fd, asyncio_poll_cb_t *input,
                           void *opaque);
 
+typedef struct asyncio_dgram_packet {
+  const void *data;
+  size_t len;
+  const struct sockaddr *addr; // NULL for connected sockets when sending
+  socklen_t addrlen;
+} asyncio_dgram_packet_t;
+
+typedef void (asyncio_dgram_cb_t)(void *opaque,
+                                  const asyncio_dgram_packet_t *pkts,
+                                  int count);
+
+/**
+ * Like asyncio_dgram() but reads are done by asyncio which delivers
+ * batches of datagrams (recvmmsg and UDP GRO on Linux). Packet data
+ * and addresses are only valid during the callback.
+ */
+asyncio_fd_t *asyncio_dgram_batch(int fd, asyncio_dgram_cb_t *input,
+                                  void *opaque);
+
+/**
+ * Send datagrams using sendmmsg and UDP GSO where available. Runs of
+ * equally sized packets to the same destination are sent as one GSO
+ * message. Does not queue: Returns number of packets sent, which is
+ * less than 'count' if the socket buffer is full, or -1 if none was
+ * sent. Can be called from any thread
+ */
+int asyncio_dgram_send(asyncio_fd_t *af, const asyncio_dgram_packet_t *pkts,
+                       int count);
+
 asyncio_fd_t *asyncio_stream(int fd,
                              asyncio_read_cb_t *read,
                              asyncio_error_cb_t *err,
@@ -97,6 +173,12 @@ asyncio_fd_t *asyncio_stream(int fd,
 
 void asyncio_close(asyncio_fd_t *af);
 
+/**
+ * Returned by the asyncio_send* functions when the send queue is above
+ * the high watermark. See asyncio_set_watermarks()
+ */
+#define ASYNCIO_SEND_BACKPRESSURE 2
+
 int asyncio_send(asyncio_fd_t *af, const void *buf, size_t len, int cork);
 
 int asyncio_send_with_hdr(asyncio_fd_t *af,
@@ -106,6 +188,9 @@ int asyncio_send_with_hdr(asyncio_fd_t *af,
 
 int asyncio_sendq(asyncio_fd_t *af, mbuf_t *hq, int cork);
 
+int asyncio_sendfile(asyncio_fd_t *af, int fd, int64_t offset, int64_t len,
+                     int cork);
+
 int asyncio_sendq_with_hdr(asyncio_fd_t *af, const void *hdr_buf,
                            size_t hdr_len, mbuf_t *q, int cork);
 
@@ -126,6 +211,59 @@ void asyncio_fd_release(asyncio_fd_t *af);
 
 int asyncio_wait_send_buffer(asyncio_fd_t *af, int size);
 
+void asyncio_set_watermarks(asyncio_fd_t *af, size_t high, size_t low,
+                            asyncio_writable_cb_t *cb, void *opaque);
+
+typedef struct asyncio_fd_stats {
+  uint64_t bytes_in;
+  uint64_t bytes_out;
+  uint64_t sendq_peak; // Largest send queue seen, in bytes
+} asyncio_fd_stats_t;
+
+void asyncio_fd_get_stats(asyncio_fd_t *af, asyncio_fd_stats_t *stats);
+
+/*************************************************************************
+ * Loop statistics
+ *************************************************************************/
+
+/**
+ * Histogram bucket 0 counts zero values and bucket N counts values in
+ * [2^(N-1), 2^N). The last bucket also counts everything above it.
+ */
+#define ASYNCIO_STATS_BUCKETS 24
+#define ASYNCIO_STATS_SLOWEST 8
+
+typedef struct asyncio_loop_stats {
+  uint64_t iterations;
+  uint64_t events;
+  uint64_t callbacks;   // fd, timer and task callbacks invoked
+  uint64_t poll_updates; // epoll_ctl() / kevent() changes
+  uint64_t busy_us;     // Time spent between waits
+  uint64_t wait_us;     // Time spent waiting for events
+
+  uint64_t busy_hist[ASYNCIO_STATS_BUCKETS];      // us per iteration
+  uint64_t wait_hist[ASYNCIO_STATS_BUCKETS];      // us per wait
+  uint64_t events_hist[ASYNCIO_STATS_BUCKETS];    // Events per wakeup
+  uint64_t timer_lag_hist[ASYNCIO_STATS_BUCKETS]; // us past at_expire
+  uint64_t timer_lag_max;
+
+  struct {
+    void *fn;
+    uint64_t us;
+  } slowest[ASYNCIO_STATS_SLOWEST]; // Slowest callbacks, slowest first
+} asyncio_loop_stats_t;
+
+/**
+ * Copy the statistics for loop 'id'. The loop updates them without
+ * locking so the snapshot is only approximately consistent.
+ * Returns -1 if there is no such loop
+ */
+int asyncio_get_loop_stats(int id, asyncio_loop_stats_t *stats);
+
+int asyncio_get_num_loops(void);
+
+uint64_t asyncio_stats_percentile(const uint64_t *hist, double q);
+
 /*************************************************************************
  * Workers
  *************************************************************************/
@@ -138,6 +276,8 @@ void asyncio_run_task(void (*fn)(void *aux), void *aux);
 
 void asyncio_run_task_blocking(void (*fn)(void *aux), void *aux);
 
+void asyncio_fd_run_task(asyncio_fd_t *af, void (*fn)(void *aux), void *aux);
+
 /************************************************************************
  * SSL / TLS
  ************************************************************************/
@@ -150,4 +290,15 @@ asyncio_sslctx_t *asyncio_sslctx_server_from_pem(const char *priv_key_pem,
 
 asyncio_sslctx_t *asyncio_sslctx_client(void);
 
+typedef struct asyncio_tls_stats {
+  uint64_t handshakes;       // Completed handshakes
+  uint64_t resumed;          // ... of which resumed a previous session
+  uint64_t failed;
+  uint64_t handshake_cpu_us; // CPU time spent in completed handshakes
+} asyncio_tls_stats_t;
+
+void asyncio_get_tls_stats(asyncio_tls_stats_t *stats);
+
+void asyncio_sslctx_retain(asyncio_sslctx_t *ctx);
+
 void asyncio_sslctx_free(asyncio_sslctx_t *ctx);
@@ -34,10 +34,15 @@
 #include <netinet/tcp.h>
 #include <string.h>
 #include <stdlib.h>
+#include <pthread.h>
+#include <sys/param.h>
 
 #include "dial.h"
 #include "sock.h"
 #include "trace.h"
+#include "misc.h"
+#include "cfg.h"
+#include "queue.h"
 
 #include <netinet/in.h>
 #include <arpa/inet.h>
@@ -62,71 +67,253 @@ getstreamsocket(int family)
 
 
 
+/**
+ * Resolved addresses for a host, in the order they should be tried
+ */
+#define DIAL_MAX_ADDRS     16
+#define DIAL_ATTEMPT_DELAY 250000 // Between staggered connects (us)
+#define DNS_CACHE_SIZE     256
+
+typedef struct dial_addr {
+  struct sockaddr_storage da_addr;
+  socklen_t da_addrlen;
+} dial_addr_t;
+
+
+/**
+ * Process wide cache of getaddrinfo() results. Failed lookups are
+ * cached as well, but with a shorter TTL
+ */
+typedef struct dns_entry {
+  TAILQ_ENTRY(dns_entry) de_link;
+  char *de_hostname;
+  int de_port;
+  int de_gai_err;
+  int64_t de_expire;
+  int de_naddrs;
+  dial_addr_t de_addrs[DIAL_MAX_ADDRS];
+} dns_entry_t;
+
+TAILQ_HEAD(dns_entry_queue, dns_entry);
+
+static struct dns_entry_queue dns_cache = TAILQ_HEAD_INITIALIZER(dns_cache);
+static int dns_cache_entries;
+static pthread_mutex_t dns_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+
+/**
+ * Entries are kept in MRU order, expired ones are dropped on lookup
+ */
+static dns_entry_t *
+dns_cache_find(const char *hostname, int port, int64_t now)
+{
+  dns_entry_t *de;
+  TAILQ_FOREACH(de, &dns_cache, de_link) {
+    if(de->de_port != port || strcmp(de->de_hostname, hostname))
+      continue;
+
+    TAILQ_REMOVE(&dns_cache, de, de_link);
+    if(de->de_expire <= now) {
+      dns_cache_entries--;
+      free(de->de_hostname);
+      free(de);
+      return NULL;
+    }
+    TAILQ_INSERT_HEAD(&dns_cache, de, de_link);
+    return de;
+  }
+  return NULL;
+}
+
+
+/**
+ *
+ */
+static void
+dns_cache_insert(const dns_entry_t *src, int ttl)
+{
+  dns_entry_t *de;
+
+  pthread_mutex_lock(&dns_cache_mutex);
+  if((de = dns_cache_find(src->de_hostname, src->de_port, 0)) == NULL) {
+    if(dns_cache_entries == DNS_CACHE_SIZE) {
+      de = TAILQ_LAST(&dns_cache, dns_entry_queue);
+      TAILQ_REMOVE(&dns_cache, de, de_link);
+      free(de->de_hostname);
+    } else {
+      de = malloc(sizeof(dns_entry_t));
+      dns_cache_entries++;
+    }
+    TAILQ_INSERT_HEAD(&dns_cache, de, de_link);
+  } else {
+    free(de->de_hostname);
+  }
+  *de = (dns_entry_t) {
+    .de_link = de->de_link,
+    .de_hostname = strdup(src->de_hostname),
+    .de_port = src->de_port,
+    .de_gai_err = src->de_gai_err,
+    .de_expire = get_ts_mono() + ttl * 1000000LL,
+    .de_naddrs = src->de_naddrs,
+  };
+  memcpy(de->de_addrs, src->de_addrs, src->de_naddrs * sizeof(dial_addr_t));
+  pthread_mutex_unlock(&dns_cache_mutex);
+}
 
 
+/**
+ * RFC 8305: Alternate between address families, starting with the
+ * family of the first (most preferred) address
+ */
+static void
+dns_entry_add_addrs(dns_entry_t *de, const struct addrinfo *res)
+{
+  const struct addrinfo *fam[2][DIAL_MAX_ADDRS];
+  int n[2] = {0, 0};
+
+  for(const struct addrinfo *ai = res; ai != NULL; ai = ai->ai_next) {
+    if(ai->ai_family != AF_INET && ai->ai_family != AF_INET6)
+      continue;
+    if(ai->ai_addrlen > sizeof(struct sockaddr_storage))
+      continue;
+    const int f = ai->ai_family != res->ai_family;
+    if(n[f] < DIAL_MAX_ADDRS)
+      fam[f][n[f]++] = ai;
+  }
+
+  de->de_naddrs = 0;
+  for(int i = 0; i < n[0] || i < n[1]; i++) {
+    for(int f = 0; f < 2; f++) {
+      if(i >= n[f] || de->de_naddrs == DIAL_MAX_ADDRS)
+        continue;
+      dial_addr_t *da = &de->de_addrs[de->de_naddrs++];
+      memcpy(&da->da_addr, fam[f][i]->ai_addr, fam[f][i]->ai_addrlen);
+      da->da_addrlen = fam[f][i]->ai_addrlen;
+    }
+  }
+}
+
+
+/**
+ * Resolve via the cache. Returns number of addresses or -1
+ */
 static int
-dial_one(const struct sockaddr *sa, socklen_t slen, int timeout,
-         const char *hostname, char *errbuf, size_t errlen)
+dns_resolve(const char *hostname, int port, dial_addr_t *addrs,
+            int *cached, char *errbuf, size_t errlen)
 {
-  char addrtxt[512];
-  int err;
-  socklen_t sockerrlen = sizeof(err);
+  dns_entry_t *de, tmp;
+  int gai_err;
+
+  pthread_mutex_lock(&dns_cache_mutex);
+  de = dns_cache_find(hostname, port, get_ts_mono());
+  if(de != NULL) {
+    const int naddrs = de->de_naddrs;
+    gai_err = de->de_gai_err;
+    memcpy(addrs, de->de_addrs, naddrs * sizeof(dial_addr_t));
+    pthread_mutex_unlock(&dns_cache_mutex);
+    *cached = 1;
+    if(gai_err)
+      goto bad;
+    return naddrs;
+  }
+  pthread_mutex_unlock(&dns_cache_mutex);
+  *cached = 0;
+
+  char service[10];
+  snprintf(service, sizeof(service), "%u", port);
+  const struct addrinfo hints = {
+    .ai_family = AF_UNSPEC,
+    .ai_socktype = SOCK_STREAM,
+  };
+  struct addrinfo *res = NULL;
+
+  memset(&tmp, 0, sizeof(tmp));
+  tmp.de_hostname = (char *)hostname;
+  tmp.de_port = port;
+
+  gai_err = getaddrinfo(hostname, service, &hints, &res);
+  if(!gai_err) {
+    dns_entry_add_addrs(&tmp, res);
+    freeaddrinfo(res);
+    if(tmp.de_naddrs == 0)
+      gai_err = EAI_FAMILY;
+  }
+  tmp.de_gai_err = gai_err;
+
+  // Don't remember local resource problems
+  if(gai_err != EAI_SYSTEM && gai_err != EAI_MEMORY) {
+    cfg_root(cr);
+    const int ttl = gai_err ?
+      cfg_get_int(cr, CFG("dial", "dns_negative_ttl"), 5) :
+      cfg_get_int(cr, CFG("dial", "dns_ttl"), 60);
+    if(ttl > 0)
+      dns_cache_insert(&tmp, ttl);
+  }
+
+  if(gai_err)
+    goto bad;
+
+  memcpy(addrs, tmp.de_addrs, tmp.de_naddrs * sizeof(dial_addr_t));
+  return tmp.de_naddrs;
+
+ bad:
+  snprintf(errbuf, errlen, "Unable to resolve %s -- %s", hostname,
+           gai_strerror(gai_err));
+  return -1;
+}
+
+
+/**
+ *
+ */
+static const char *
+dial_addrtxt(const dial_addr_t *da, char *buf, size_t len)
+{
+  const struct sockaddr *sa = (const struct sockaddr *)&da->da_addr;
 
   switch(sa->sa_family) {
   case AF_INET:
-    inet_ntop(AF_INET, &((const struct sockaddr_in *)sa)->sin_addr,
-              addrtxt, sizeof(addrtxt));
-    break;
+    return inet_ntop(AF_INET, &((const struct sockaddr_in *)sa)->sin_addr,
+                     buf, len);
   case AF_INET6:
-    inet_ntop(AF_INET6, &((const struct sockaddr_in6 *)sa)->sin6_addr,
-              addrtxt, sizeof(addrtxt));
-    break;
+    return inet_ntop(AF_INET6, &((const struct sockaddr_in6 *)sa)->sin6_addr,
+                     buf, len);
   default:
-    snprintf(errbuf, errlen, "Invalid address family %d", sa->sa_family);
-    return -1;
+    snprintf(buf, len, "<family %d>", sa->sa_family);
+    return buf;
   }
+}
 
-  int fd = getstreamsocket(sa->sa_family);
-  int r = connect(fd, sa, slen);
-  if(r == -1) {
-    if(errno == EINPROGRESS) {
-      struct pollfd pfd;
-
-      pfd.fd = fd;
-      pfd.events = POLLOUT;
-      pfd.revents = 0;
-
-      r = poll(&pfd, 1, timeout);
-      if(r == 0) {
-        /* Timeout */
-        close(fd);
-        snprintf(errbuf, errlen, "Connection to %s timed out",
-                 addrtxt);
-        return -1;
-      }
-
-      if(r == -1) {
-        snprintf(errbuf, errlen, "Connection to %s failed -- %s",
-                 addrtxt, strerror(errno));
-        close(fd);
-        return -1;
-      }
-
-      getsockopt(fd, SOL_SOCKET, SO_ERROR, (void *)&err, &sockerrlen);
-    } else {
-      err = errno;
-    }
-  } else {
-    err = 0;
-  }
 
-  if(err != 0) {
+/**
+ * Start a non-blocking connect. Returns fd or -errno
+ */
+static int
+dial_start(const dial_addr_t *da, int *connected)
+{
+  const struct sockaddr *sa = (const struct sockaddr *)&da->da_addr;
+  int fd = getstreamsocket(sa->sa_family);
+  if(fd < 0)
+    return fd;
+
+  *connected = 0;
+  if(connect(fd, sa, da->da_addrlen) == 0) {
+    *connected = 1;
+  } else if(errno != EINPROGRESS) {
+    const int err = errno;
     close(fd);
-    snprintf(errbuf, errlen, "Connection to %s failed -- %s",
-             addrtxt, strerror(err));
-    return -1;
+    return -err;
   }
+  return fd;
+}
+
 
+/**
+ *
+ */
+static void
+dial_setup_connected(int fd)
+{
   fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
 
   int val = 1;
@@ -149,8 +336,112 @@ dial_one(const struct sockaddr *sa, socklen_t slen, int timeout,
   val = 5;
   setsockopt(fd, IPPROTO_TCP, TCP_KEEPCNT, &val, sizeof(val));
 #endif
+}
 
-  return fd;
+
+/**
+ * Happy eyeballs (RFC 8305). A new attempt is started every
+ * DIAL_ATTEMPT_DELAY, or right away when one fails, while earlier ones
+ * are still pending. The first to connect wins. Returns index of the
+ * winning address with its fd in *fdp, or -1
+ */
+static int
+dial_addrs(const dial_addr_t *addrs, int naddrs, int timeout,
+           const char *hostname, int *fdp, char *errbuf, size_t errlen)
+{
+  struct pollfd pfd[DIAL_MAX_ADDRS];
+  int idx[DIAL_MAX_ADDRS];
+  int npfd = 0, next = 0, err = 0, failed = -1, winner = -1;
+  const int64_t deadline =
+    timeout < 0 ? INT64_MAX : get_ts_mono() + timeout * 1000LL;
+  int64_t next_attempt = 0;
+
+  while(winner == -1) {
+    const int64_t now = get_ts_mono();
+
+    while(next < naddrs && (npfd == 0 || now >= next_attempt)) {
+      int connected;
+      const int fd = dial_start(&addrs[next], &connected);
+      if(fd < 0) {
+        err = -fd;
+        failed = next++;
+        continue;
+      }
+      if(connected) {
+        *fdp = fd;
+        winner = next;
+        break;
+      }
+      pfd[npfd].fd = fd;
+      pfd[npfd].events = POLLOUT;
+      pfd[npfd].revents = 0;
+      idx[npfd++] = next++;
+      next_attempt = now + DIAL_ATTEMPT_DELAY;
+    }
+
+    if(winner != -1 || npfd == 0)
+      break;
+
+    if(now >= deadline) {
+      err = ETIMEDOUT;
+      break;
+    }
+
+    int64_t wait = MIN(deadline - now, 1000000000LL);
+    if(next < naddrs)
+      wait = MIN(wait, next_attempt - now);
+
+    const int r = poll(pfd, npfd, (wait + 999) / 1000);
+    if(r == -1) {
+      if(errno == EINTR)
+        continue;
+      err = errno;
+      break;
+    }
+
+    for(int i = 0; i < npfd; i++) {
+      if(!pfd[i].revents)
+        continue;
+
+      int e = 0;
+      socklen_t elen = sizeof(e);
+      getsockopt(pfd[i].fd, SOL_SOCKET, SO_ERROR, (void *)&e, &elen);
+      if(e == 0) {
+        *fdp = pfd[i].fd;
+        winner = idx[i];
+        pfd[i] = pfd[--npfd];
+        break;
+      }
+
+      err = e;
+      failed = idx[i];
+      close(pfd[i].fd);
+      pfd[i] = pfd[npfd - 1];
+      idx[i] = idx[npfd - 1];
+      npfd--;
+      i--;
+      next_attempt = 0;
+    }
+  }
+
+  for(int i = 0; i < npfd; i++)
+    close(pfd[i].fd);
+
+  if(winner != -1)
+    return winner;
+
+  char addrtxt[64];
+  if(err == ETIMEDOUT) {
+    snprintf(errbuf, errlen, "Connection to %s timed out", hostname);
+  } else if(failed == -1) {
+    snprintf(errbuf, errlen, "Connection to %s failed -- %s",
+             hostname, strerror(err));
+  } else {
+    snprintf(errbuf, errlen, "Connection to %s failed -- %s",
+             dial_addrtxt(&addrs[failed], addrtxt, sizeof(addrtxt)),
+             strerror(err));
+  }
+  return -1;
 }
 
 
@@ -161,26 +452,28 @@ int
 dialfd(const char *hostname, int port, int timeout,
        char *errbuf, size_t errlen)
 {
-  char service[10];
-  snprintf(service, sizeof(service), "%u", port);
-  struct addrinfo *res = NULL;
-  const int gai_err = getaddrinfo(hostname, service, NULL, &res);
-  if(gai_err) {
-    snprintf(errbuf, errlen, "Unable to resolve %s -- %s", hostname,
-             gai_strerror(gai_err));
+  dial_addr_t addrs[DIAL_MAX_ADDRS];
+  int cached, fd;
+  char addrtxt[64];
+
+  const int64_t t0 = get_ts_mono();
+  const int naddrs = dns_resolve(hostname, port, addrs, &cached,
+                                 errbuf, errlen);
+  if(naddrs < 0)
     return -1;
-  }
 
-  const struct addrinfo *ai = res;
-  int fd = -1;
-  while(ai) {
-    fd = dial_one(ai->ai_addr, ai->ai_addrlen, timeout, hostname,
-                  errbuf, errlen);
-    if(fd >= 0)
-      break;
-    ai = ai->ai_next;
-  }
-  freeaddrinfo(res);
+  const int64_t t1 = get_ts_mono();
+  const int i = dial_addrs(addrs, naddrs, timeout, hostname, &fd,
+                           errbuf, errlen);
+  if(i < 0)
+    return -1;
+
+  dial_setup_connected(fd);
+
+  trace(LOG_DEBUG, "Connected to %s:%d (%s) in %d ms, DNS %d ms%s",
+        hostname, port, dial_addrtxt(&addrs[i], addrtxt, sizeof(addrtxt)),
+        (int)((get_ts_mono() - t1) / 1000), (int)((t1 - t0) / 1000),
+        cached ? " (cached)" : "");
   return fd;
 }
 
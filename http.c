@@ -71,10 +71,13 @@ typedef struct http_server {
 
   asyncio_fd_t *hs_fd;
 
+  pthread_mutex_t hs_sslctx_mutex;
   asyncio_sslctx_t *hs_sslctx;
 
   http_sniffer_t *hs_sniffer;
 
+  asyncio_bind_opts_t hs_bind_opts;
+
 } http_server_t;
 
 
@@ -198,6 +201,7 @@ http_server_release(http_server_t *hs)
   if(hs->hs_sslctx != NULL)
     asyncio_sslctx_free(hs->hs_sslctx);
   hs->hs_sslctx = NULL;
+  pthread_mutex_destroy(&hs->hs_sslctx_mutex);
 
   free(hs->hs_real_ip_header);
   free(hs->hs_bind_address);
@@ -877,7 +881,7 @@ http_request_destroy(http_request_t *hr)
       asyncio_shutdown(hc->hc_af);
       // FALLTHRU. We need to reenable so we can catch when the socket closes
     case 1:
-      asyncio_run_task(http_connection_reenable, hc);
+      asyncio_fd_run_task(hc->hc_af, http_connection_reenable, hc);
       break;
     case 2: // Websocket
       http_connection_release(hc);
@@ -1538,9 +1542,19 @@ http_server_accept(void *opaque, int fd, struct sockaddr *peer,
 
   hc->hc_server = hs;
   atomic_inc(&hs->hs_refcount);
+
+  // Listeners on other loops may accept while the context is replaced
+  pthread_mutex_lock(&hs->hs_sslctx_mutex);
+  asyncio_sslctx_t *sslctx = hs->hs_sslctx;
+  if(sslctx != NULL)
+    asyncio_sslctx_retain(sslctx);
+  pthread_mutex_unlock(&hs->hs_sslctx_mutex);
+
   hc->hc_af = asyncio_stream(fd, http_server_read, http_server_error, hc,
                              ASYNCIO_FLAG_THREAD_SAFE,
-                             hs->hs_sslctx, NULL);
+                             sslctx, NULL);
+  if(sslctx != NULL)
+    asyncio_sslctx_free(sslctx);
 
   asyncio_timer_init(&hc->hc_timer, http_server_timeout, hc);
   asyncio_timer_arm_delta(&hc->hc_timer, 10 * 1000000);
@@ -1555,8 +1569,8 @@ static void
 http_server_start(void *aux)
 {
   http_server_t *hs = aux;
-  hs->hs_fd = asyncio_bind(hs->hs_bind_address, hs->hs_port,
-                           http_server_accept, hs);
+  hs->hs_fd = asyncio_bind_ex(hs->hs_bind_address, hs->hs_port,
+                              &hs->hs_bind_opts, http_server_accept, hs);
 
   if(hs->hs_fd == NULL) {
     trace(LOG_ERR, "HTTP: Failed to bind %s:%d",
@@ -1596,6 +1610,7 @@ http_server_init(const char *config_prefix)
 
   http_server_t *hs = calloc(1, sizeof(http_server_t));
   atomic_set(&hs->hs_refcount, 1);
+  pthread_mutex_init(&hs->hs_sslctx_mutex, NULL);
   hs->hs_port = cfg_get_int(cr, CFG(config_prefix, "port"), 9000);
 
 
@@ -1617,6 +1632,15 @@ http_server_init(const char *config_prefix)
 
   hs->hs_secure_cookies = cfg_get_int(cr, CFG(config_prefix, "secureCookies"), 0);
 
+  hs->hs_bind_opts.backlog =
+    cfg_get_int(cr, CFG(config_prefix, "listenBacklog"), 0);
+  hs->hs_bind_opts.defer_accept =
+    cfg_get_int(cr, CFG(config_prefix, "deferAccept"), 0);
+  hs->hs_bind_opts.fastopen =
+    cfg_get_int(cr, CFG(config_prefix, "fastOpen"), 0);
+  hs->hs_bind_opts.max_accept_rate =
+    cfg_get_int(cr, CFG(config_prefix, "maxAcceptRate"), 0);
+
   const char *priv_key_file =
     cfg_get_str(cr, CFG(config_prefix, "privateKeyFile"), NULL);
 
@@ -1639,6 +1663,7 @@ http_server_create(int port, const char *bind_address, void *sslctx,
 {
   http_server_t *hs = calloc(1, sizeof(http_server_t));
   atomic_set(&hs->hs_refcount, 1);
+  pthread_mutex_init(&hs->hs_sslctx_mutex, NULL);
   hs->hs_port = port;
   hs->hs_bind_address = bind_address ? strdup(bind_address) : NULL;
   hs->hs_sslctx = sslctx;
@@ -1664,9 +1689,12 @@ http_server_update_sslctx_onthread(void *opaque)
 {
   http_server_aux_t *hsa = opaque;
   http_server_t *hs = hsa->hs;
-  if(hs->hs_sslctx != NULL)
-    asyncio_sslctx_free(hs->hs_sslctx);
+  pthread_mutex_lock(&hs->hs_sslctx_mutex);
+  asyncio_sslctx_t *old = hs->hs_sslctx;
   hs->hs_sslctx = hsa->aux;
+  pthread_mutex_unlock(&hs->hs_sslctx_mutex);
+  if(old != NULL)
+    asyncio_sslctx_free(old);
   free(hsa);
 }
 
@@ -28,6 +28,7 @@
 #include <string.h>
 #include <stdarg.h>
 #include <sys/param.h>
+#include <sys/uio.h>
 
 #include "mbuf.h"
 #include "trace.h"
@@ -155,6 +156,50 @@ mbuf_append_prealloc(mbuf_t *mq, void *buf, size_t len)
   md->md_data_off = 0;
 }
 
+
+/**
+ * Like mbuf_append_prealloc() but 'buf' is 'size' bytes large of which
+ * the first 'len' are valid. The rest is used by subsequent appends
+ */
+void
+mbuf_append_chunk(mbuf_t *mq, void *buf, size_t size, size_t len)
+{
+  mbuf_append_prealloc(mq, buf, len);
+  TAILQ_LAST(&mq->mq_buffers, mbuf_data_queue)->md_data_size = size;
+}
+
+
+/**
+ * Return unused space at end of the last buffer, for reading directly
+ * into the queue. Follow up with mbuf_commit_tail()
+ */
+void *
+mbuf_tail_space(mbuf_t *mq, size_t *lenp)
+{
+  mbuf_data_t *md = TAILQ_LAST(&mq->mq_buffers, mbuf_data_queue);
+  if(md == NULL) {
+    *lenp = 0;
+    return NULL;
+  }
+  *lenp = md->md_data_size - md->md_data_len;
+  return md->md_data + md->md_data_len;
+}
+
+
+/**
+ *
+ */
+void
+mbuf_commit_tail(mbuf_t *mq, size_t len)
+{
+  if(len == 0)
+    return;
+  mbuf_data_t *md = TAILQ_LAST(&mq->mq_buffers, mbuf_data_queue);
+  assert(md->md_data_len + len <= md->md_data_size);
+  md->md_data_len += len;
+  mq->mq_size += len;
+}
+
 /**
  *
  */
@@ -246,6 +291,35 @@ mbuf_peek_no_copy(mbuf_t *mq, const void **buf)
 }
 
 
+/**
+ * Describe (at most iovcnt) buffers in the queue without copying.
+ * Returns number of iovecs filled in, total length is stored in *bytesp
+ */
+int
+mbuf_peek_iovec(mbuf_t *mq, struct iovec *iov, int iovcnt, size_t *bytesp)
+{
+  const mbuf_data_t *md;
+  size_t bytes = 0;
+  int n = 0;
+
+  TAILQ_FOREACH(md, &mq->mq_buffers, md_link) {
+    if(n == iovcnt)
+      break;
+    const size_t len = md->md_data_len - md->md_data_off;
+    if(len == 0)
+      continue;
+    iov[n].iov_base = md->md_data + md->md_data_off;
+    iov[n].iov_len = len;
+    bytes += len;
+    n++;
+  }
+
+  if(bytesp != NULL)
+    *bytesp = bytes;
+  return n;
+}
+
+
 
 /**
  *
@@ -71,6 +71,12 @@ void mbuf_append_str(mbuf_t *m, const char *buf);
 
 void mbuf_append_prealloc(mbuf_t *m, void *buf, size_t len);
 
+void mbuf_append_chunk(mbuf_t *m, void *buf, size_t size, size_t len);
+
+void *mbuf_tail_space(mbuf_t *m, size_t *lenp);
+
+void mbuf_commit_tail(mbuf_t *m, size_t len);
+
 void mbuf_append_FILE(mbuf_t *m, FILE *fp);
 
 void mbuf_prepend(mbuf_t *m, const void *buf, size_t len);
@@ -81,6 +87,11 @@ size_t mbuf_peek(mbuf_t *m, void *buf, size_t len);
 
 size_t mbuf_peek_no_copy(mbuf_t *mq, const void **buf);
 
+struct iovec;
+
+int mbuf_peek_iovec(mbuf_t *mq, struct iovec *iov, int iovcnt,
+                    size_t *bytesp);
+
 size_t mbuf_peek_tail(mbuf_t *mq, void *buf, size_t len);
 
 size_t mbuf_drop(mbuf_t *m, size_t len);
@@ -50,6 +50,23 @@ libsvc_accept(int fd, struct sockaddr *sa, socklen_t *addrlen)
 }
 
 
+/**
+ *
+ */
+int
+libsvc_accept_nonblock(int fd, struct sockaddr *sa, socklen_t *addrlen)
+{
+#ifdef linux
+  return accept4(fd, sa, addrlen, SOCK_CLOEXEC | SOCK_NONBLOCK);
+#else
+  int r = libsvc_accept(fd, sa, addrlen);
+  if(r >= 0)
+    fcntl(r, F_SETFL, fcntl(r, F_GETFL) | O_NONBLOCK);
+  return r;
+#endif
+}
+
+
 /**
  *
  */
@@ -28,6 +28,8 @@
 struct sockaddr;
 int libsvc_accept(int fd, struct sockaddr *sa, socklen_t *addrlen);
 
+int libsvc_accept_nonblock(int fd, struct sockaddr *sa, socklen_t *addrlen);
+
 int libsvc_socket(int domain, int type, int protocol);
 
 int libsvc_pipe(int pipefd[2]);
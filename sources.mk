@@ -147,6 +147,12 @@ ifeq (${WITH_ASYNCIO},yes)
 libsvc_SRCS +=  asyncio.c stream.c
 libsvc_INCS +=  asyncio.h stream.h
 CFLAGS +=  -DWITH_ASYNCIO
+
+ifeq ($(shell uname),Linux)
+ifeq (${WITH_IO_URING},yes)
+CFLAGS +=  -DWITH_IO_URING
+endif
+endif
 endif
 
 ##############################################################
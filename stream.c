@@ -58,6 +58,20 @@ stream_bytes_avail(void *opaque, struct mbuf *mq)
 }
 
 
+/**
+ * All outbound TLS streams share one client context so CA certificates
+ * are only loaded once. Sessions are resumed per hostname:port by asyncio.
+ */
+static asyncio_sslctx_t *stream_sslctx;
+static pthread_once_t stream_sslctx_once = PTHREAD_ONCE_INIT;
+
+static void
+stream_sslctx_init(void)
+{
+  stream_sslctx = asyncio_sslctx_client();
+}
+
+
 stream_t *
 stream_connect(const char *hostname, int port, int timeout_ms,
                char *errbuf, size_t errlen, int flags)
@@ -72,8 +86,11 @@ stream_connect(const char *hostname, int port, int timeout_ms,
   pthread_cond_init(&s->s_recv_cond, NULL);
   pthread_mutex_init(&s->s_recv_mutex, NULL);
 
-  asyncio_sslctx_t *sslctx = flags & STREAM_CONNECT_F_SSL ?
-    asyncio_sslctx_client() : NULL;
+  asyncio_sslctx_t *sslctx = NULL;
+  if(flags & STREAM_CONNECT_F_SSL) {
+    pthread_once(&stream_sslctx_once, stream_sslctx_init);
+    sslctx = stream_sslctx;
+  }
 
   int asyncio_flags = ASYNCIO_FLAG_THREAD_SAFE;
   if(!(flags & STREAM_CONNECT_F_SSL_DONT_VERIFY))
@@ -81,8 +98,6 @@ stream_connect(const char *hostname, int port, int timeout_ms,
 
   s->s_af = asyncio_stream(fd, stream_bytes_avail, stream_error,
                            s, asyncio_flags, sslctx, hostname);
-  if(sslctx != NULL)
-    asyncio_sslctx_free(sslctx);
   return s;
 }
 